@@ -0,0 +1,122 @@
+/**
+ © 2020 William MacKay.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ See the GNU General Public License for more details:
+ <http://www.gnu.org/copyleft/gpl.html>
+*/
+
+// Times the color_delta kernels the way the optimizer calls them for each
+// pixel: seven differences, three second differences and distances, and
+// one diffusion. Build it with and without -DPNGLOSS_NO_SIMD to compare.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "color_delta.h"
+
+#define PIXELS 4096
+#define ROUNDS 2000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t bench_pixel(
+    uint_fast8_t bytes_per_pixel, int_least16_t (*colors)[4], uint32_t x,
+    color_delta *error_rows[3]
+) {
+    int_least16_t *original = colors[x];
+    int_least16_t *back = colors[x + 1];
+    int_least16_t *here = colors[x + 2];
+    int_least16_t *old_above = colors[x + 3];
+    int_least16_t *new_above = colors[x + 4];
+    int_least16_t *old_left = colors[x + 5];
+    int_least16_t *new_left = colors[x + 6];
+
+    color_delta difference;
+    color_difference(bytes_per_pixel, difference, back, here);
+    color_delta_diffuse(difference, 2, error_rows[0] + x, error_rows[1] + x, error_rows[2] + x);
+
+    color_delta old_partial, new_partial;
+    color_d2 d2;
+    uint32_t total = 0;
+    color_difference(bytes_per_pixel, old_partial, original, old_above);
+    color_difference(bytes_per_pixel, new_partial, back, new_above);
+    color_delta_difference(new_partial, old_partial, d2);
+    total += color_delta_distance(d2);
+    color_difference(bytes_per_pixel, old_partial, original, old_left);
+    color_difference(bytes_per_pixel, new_partial, back, new_left);
+    color_delta_difference(new_partial, old_partial, d2);
+    total += color_delta_distance(d2);
+    color_difference(bytes_per_pixel, old_partial, original, old_above);
+    color_difference(bytes_per_pixel, new_partial, back, new_left);
+    color_delta_difference(new_partial, old_partial, d2);
+    total += color_delta_distance(d2);
+    return total;
+}
+
+int main(void) {
+    static int_least16_t colors[PIXELS + 8][4];
+    static color_delta error[3][PIXELS + 8];
+    color_delta *error_rows[3] = {error[0], error[1], error[2]};
+
+    srand(1);
+    for (uint32_t x = 0; x < PIXELS + 8; x++) {
+        for (uint_fast8_t c = 0; c < 4; c++) {
+            colors[x][c] = rand() % 256;
+        }
+    }
+
+#ifdef COLOR_DELTA_SSE2
+    const char *kernels = "sse2";
+#else
+    const char *kernels = "scalar";
+#endif
+
+    // the switch on bytes_per_pixel folds away like in the optimizer
+    for (uint_fast8_t bytes_per_pixel = 1; bytes_per_pixel <= 4; bytes_per_pixel++) {
+        memset(error, 0, sizeof(error));
+        uint32_t checksum = 0;
+        double start = now();
+        for (uint32_t round = 0; round < ROUNDS; round++) {
+            for (uint32_t x = 0; x < PIXELS; x++) {
+                switch (bytes_per_pixel) {
+                    case 1:
+                        checksum += bench_pixel(1, colors, x, error_rows);
+                        break;
+                    case 2:
+                        checksum += bench_pixel(2, colors, x, error_rows);
+                        break;
+                    case 3:
+                        checksum += bench_pixel(3, colors, x, error_rows);
+                        break;
+                    default:
+                        checksum += bench_pixel(4, colors, x, error_rows);
+                        break;
+                }
+            }
+        }
+        double elapsed = now() - start;
+        printf(
+            "%-6s bytes/pixel %u: %6.2f ns/pixel (checksum %08x)\n",
+            kernels, (unsigned int)bytes_per_pixel,
+            elapsed * 1e9 / ((double)ROUNDS * PIXELS), (unsigned int)checksum
+        );
+    }
+
+    return 0;
+}
@@ -0,0 +1,417 @@
+/**
+ © 2020 William MacKay.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ See the GNU General Public License for more details:
+ <http://www.gnu.org/copyleft/gpl.html>
+*/
+
+// Times every phase of compressing a corpus of PNG files in memory:
+// decoding, setting up the optimizer, optimizing rows and writing with
+// zlib. The corpus is a set of generated images in each pixel format plus
+// any files named on the command line. Results are printed as JSON so runs
+// can be saved and compared.
+//
+//   pngloss_bench [-s strength] [-b bleed_divider] [-n runs] [-l] [-e effort] [file.png ...]
+//
+// Each phase reports its fastest time over the runs. -l writes with the
+// latency zlib preset instead of maximum compression. -e is fast, medium,
+// exhaustive (the default) or all, which runs the corpus at each effort
+// so their sizes and times can be compared.
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pngloss_image.h"
+#include "rwpng.h"
+
+typedef struct {
+    char name[256];
+    unsigned char *png;
+    size_t png_size;
+} bench_input;
+
+typedef struct {
+    double decode_seconds;
+    double state_init_seconds;
+    double rows_seconds;
+    double write_seconds;
+} bench_times;
+
+static const char *pixel_formats[4] = {"gray", "gray+alpha", "rgb", "rgba"};
+// indexed by optimize_effort
+static const char *effort_names[3] = {"fast", "medium", "exhaustive"};
+
+// a repeatable hash for noise, so every run sees the same corpus
+static uint32_t bench_noise(uint32_t x, uint32_t y, uint32_t c) {
+    uint32_t h = x * 0x9E3779B1u ^ y * 0x85EBCA77u ^ c * 0xC2B2AE3Du;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 12;
+    return h;
+}
+
+// Smooth gradients with a little noise, roughly like a photo, plus a block
+// of flat color. Formats with alpha fade out to fully transparent.
+static pngloss_error bench_generate(
+    bench_input *input, uint_fast8_t format, uint32_t width, uint32_t height
+) {
+    png24_image image = {
+        .width = width,
+        .height = height,
+        .gamma = 0.45455,
+        .input_color = RWPNG_SRGB,
+        .output_color = RWPNG_SRGB
+    };
+    bool gray = format < 2;
+    bool alpha = format & 1;
+
+    image.rgba_data = malloc((size_t)width * height * 4);
+    image.row_pointers = malloc((size_t)height * sizeof(unsigned char *));
+    if (!image.rgba_data || !image.row_pointers) {
+        rwpng_free_image24(&image);
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    for (uint32_t y = 0; y < height; y++) {
+        image.row_pointers[y] = image.rgba_data + (size_t)y * width * 4;
+        for (uint32_t x = 0; x < width; x++) {
+            unsigned char *pixel = image.row_pointers[y] + (size_t)x * 4;
+            bool flat = x < width / 4 && y < height / 4;
+            for (uint_fast8_t c = 0; c < 3; c++) {
+                uint32_t value = (x * (c + 1) * 255 / width + y * (3 - c) * 255 / height) / 2;
+                if (!flat) {
+                    value += bench_noise(x, y, gray ? 0 : c) % 17;
+                }
+                pixel[c] = flat ? 200 : value > 255 ? 255 : value;
+            }
+            if (gray) {
+                pixel[0] = pixel[2] = pixel[1];
+            }
+            pixel[3] = alpha ? (x < width / 8 ? 0 : 255 - 255 * y / height) : 255;
+        }
+    }
+
+    snprintf(
+        input->name, sizeof(input->name), "synthetic-%s-%ux%u",
+        pixel_formats[format], (unsigned int)width, (unsigned int)height
+    );
+    pngloss_error retval = rwpng_write_image24_buffer(&image, NULL, NULL, &input->png, &input->png_size);
+    rwpng_free_image24(&image);
+    return retval;
+}
+
+static pngloss_error bench_load(bench_input *input, const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return READ_ERROR;
+    }
+
+    pngloss_error retval = SUCCESS;
+    size_t capacity = 1 << 16;
+    input->png = malloc(capacity);
+    input->png_size = 0;
+    while (SUCCESS == retval && input->png) {
+        input->png_size += fread(input->png + input->png_size, 1, capacity - input->png_size, fp);
+        if (input->png_size < capacity) {
+            break;
+        }
+        capacity *= 2;
+        unsigned char *png = realloc(input->png, capacity);
+        if (!png) {
+            retval = OUT_OF_MEMORY_ERROR;
+        } else {
+            input->png = png;
+        }
+    }
+    if (!input->png) {
+        retval = OUT_OF_MEMORY_ERROR;
+    }
+    if (ferror(fp)) {
+        retval = READ_ERROR;
+    }
+    fclose(fp);
+
+    const char *name = strrchr(filename, '/');
+    snprintf(input->name, sizeof(input->name), "%s", name ? name + 1 : filename);
+    return retval;
+}
+
+// the format the optimizer narrowed to, which is also what gets written
+static const char *bench_pixel_format(png24_image *image) {
+    return pixel_formats[image->bytes_per_pixel - 1];
+}
+
+static pngloss_error bench_run(
+    bench_input *input, const optimize_options *options,
+    const rwpng_deflate_options *deflate, bench_times *times,
+    png24_image *image, size_t *output_size
+) {
+    unsigned char *row_filters = NULL;
+    unsigned char *output = NULL;
+    optimize_stats stats = {0};
+    optimize_options run_options = *options;
+    run_options.stats = &stats;
+
+    double start = optimize_stats_now();
+    pngloss_error retval = rwpng_read_image24_buffer(input->png, input->png_size, image, false, false);
+    times->decode_seconds = optimize_stats_now() - start;
+
+    if (SUCCESS == retval) {
+        row_filters = memory_arena_alloc(options->arena, image->height);
+        if (!row_filters) {
+            retval = OUT_OF_MEMORY_ERROR;
+        }
+    }
+    if (SUCCESS == retval) {
+        retval = optimize_native_rows(image->row_pointers, image->width, image->height, &image->bytes_per_pixel, row_filters, &run_options);
+        times->state_init_seconds = stats.state_init_seconds;
+        times->rows_seconds = stats.rows_seconds;
+    }
+    if (SUCCESS == retval) {
+        start = optimize_stats_now();
+        retval = rwpng_write_image24_buffer(image, row_filters, deflate, &output, output_size);
+        times->write_seconds = optimize_stats_now() - start;
+    }
+
+    free(output);
+    // later runs reuse the memory, like pngloss does from file to file
+    memory_arena_reset(options->arena);
+    return retval;
+}
+
+static void bench_keep_fastest(bench_times *fastest, const bench_times *times) {
+    if (fastest->decode_seconds > times->decode_seconds) {
+        fastest->decode_seconds = times->decode_seconds;
+    }
+    if (fastest->state_init_seconds > times->state_init_seconds) {
+        fastest->state_init_seconds = times->state_init_seconds;
+    }
+    if (fastest->rows_seconds > times->rows_seconds) {
+        fastest->rows_seconds = times->rows_seconds;
+    }
+    if (fastest->write_seconds > times->write_seconds) {
+        fastest->write_seconds = times->write_seconds;
+    }
+}
+
+// JSON strings, for file names
+static void bench_print_string(const char *string) {
+    putchar('"');
+    for (; *string; string++) {
+        unsigned char c = *string;
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+// Runs every input at options->effort and prints them and their total as
+// one JSON object.
+static int bench_effort(
+    bench_input *inputs, size_t input_count, const optimize_options *options,
+    const rwpng_deflate_options *deflate, unsigned long runs, bool first
+) {
+    bench_times total = {0};
+    uint64_t total_pixels = 0;
+    size_t total_input = 0, total_output = 0;
+    int retval = SUCCESS;
+    printf("%s\n    {\"effort\": \"%s\", \"images\": [", first ? "" : ",", effort_names[options->effort]);
+    for (size_t i = 0; i < input_count; i++) {
+        bench_input *input = &inputs[i];
+        bench_times fastest = {1e30, 1e30, 1e30, 1e30};
+        const char *pixel_format = NULL;
+        uint32_t width = 0, height = 0;
+        size_t output_size = 0;
+        pngloss_error run_retval = SUCCESS;
+
+        for (unsigned long run = 0; SUCCESS == run_retval && run < runs; run++) {
+            png24_image image = {.width = 0};
+            bench_times times = {0};
+            run_retval = bench_run(input, options, deflate, &times, &image, &output_size);
+            if (SUCCESS == run_retval) {
+                bench_keep_fastest(&fastest, &times);
+                width = image.width;
+                height = image.height;
+                if (!pixel_format) {
+                    // the optimized pixels, which have the same format
+                    pixel_format = bench_pixel_format(&image);
+                }
+            }
+            rwpng_free_image24(&image);
+        }
+        if (SUCCESS != run_retval) {
+            fprintf(stderr, "%s failed with error %d\n", input->name, (int)run_retval);
+            retval = run_retval;
+            continue;
+        }
+
+        double seconds = fastest.decode_seconds + fastest.state_init_seconds +
+            fastest.rows_seconds + fastest.write_seconds;
+        uint64_t pixels = (uint64_t)width * height;
+        total.decode_seconds += fastest.decode_seconds;
+        total.state_init_seconds += fastest.state_init_seconds;
+        total.rows_seconds += fastest.rows_seconds;
+        total.write_seconds += fastest.write_seconds;
+        total_pixels += pixels;
+        total_input += input->png_size;
+        total_output += output_size;
+
+        printf("%s\n      {\"name\": ", i ? "," : "");
+        bench_print_string(input->name);
+        printf(
+            ", \"format\": \"%s\", \"width\": %u, \"height\": %u,"
+            " \"input_bytes\": %zu, \"output_bytes\": %zu, \"ratio\": %.4f,"
+            " \"decode_seconds\": %.6f, \"state_init_seconds\": %.6f,"
+            " \"rows_seconds\": %.6f, \"write_seconds\": %.6f,"
+            " \"total_seconds\": %.6f, \"mpix_per_second\": %.3f}",
+            pixel_format, (unsigned int)width, (unsigned int)height,
+            input->png_size, output_size,
+            (double)output_size / (double)input->png_size,
+            fastest.decode_seconds, fastest.state_init_seconds,
+            fastest.rows_seconds, fastest.write_seconds,
+            seconds, seconds > 0 ? (double)pixels / 1e6 / seconds : 0
+        );
+    }
+
+    double seconds = total.decode_seconds + total.state_init_seconds +
+        total.rows_seconds + total.write_seconds;
+    printf(
+        "\n    ], \"total\": {\"pixels\": %llu, \"input_bytes\": %zu,"
+        " \"output_bytes\": %zu, \"ratio\": %.4f, \"decode_seconds\": %.6f,"
+        " \"state_init_seconds\": %.6f, \"rows_seconds\": %.6f,"
+        " \"write_seconds\": %.6f, \"total_seconds\": %.6f,"
+        " \"mpix_per_second\": %.3f}}",
+        (unsigned long long)total_pixels, total_input, total_output,
+        total_input ? (double)total_output / (double)total_input : 0,
+        total.decode_seconds, total.state_init_seconds, total.rows_seconds,
+        total.write_seconds, seconds,
+        seconds > 0 ? (double)total_pixels / 1e6 / seconds : 0
+    );
+    return retval;
+}
+
+int main(int argc, char *argv[]) {
+    memory_arena arena;
+    memory_arena_init(&arena);
+    optimize_options options = {
+        .quantization_strength = 19,
+        .bleed_divider = 2,
+        .strip_threads = 1,
+        .filter_threads = 1,
+        .effort = optimize_effort_exhaustive,
+        .verbose = false,
+        .arena = &arena
+    };
+    const rwpng_deflate_options *deflate = &rwpng_deflate_max;
+    unsigned long runs = 3;
+    bool all_efforts = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:b:n:le:")) != -1) {
+        unsigned long value = optarg ? strtoul(optarg, NULL, 10) : 0;
+        switch (opt) {
+            case 's':
+                options.quantization_strength = value > 255 ? 255 : value;
+                break;
+            case 'b':
+                options.bleed_divider = value < 1 ? 1 : value > 32767 ? 32767 : value;
+                break;
+            case 'n':
+                runs = value < 1 ? 1 : value;
+                break;
+            case 'l':
+                deflate = &rwpng_deflate_latency;
+                break;
+            case 'e':
+                if (strcmp(optarg, "all") == 0) {
+                    all_efforts = true;
+                    break;
+                }
+                value = optimize_effort_exhaustive + 1;
+                for (int effort = optimize_effort_fast; effort <= optimize_effort_exhaustive; effort++) {
+                    if (strcmp(optarg, effort_names[effort]) == 0) {
+                        value = effort;
+                    }
+                }
+                if (value > optimize_effort_exhaustive) {
+                    fputs("-e must be fast, medium, exhaustive or all\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                options.effort = value;
+                break;
+            default:
+                fputs("usage: pngloss_bench [-s strength] [-b bleed_divider] [-n runs] [-l] [-e effort] [file.png ...]\n", stderr);
+                return INVALID_ARGUMENT;
+        }
+    }
+
+    static const uint32_t sizes[][2] = {{64, 64}, {512, 512}, {1024, 768}};
+    const size_t size_count = sizeof(sizes) / sizeof(sizes[0]);
+    size_t input_count = 4 * size_count + (size_t)(argc - optind);
+    bench_input *inputs = calloc(input_count, sizeof(bench_input));
+    if (!inputs) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    size_t loaded = 0;
+    for (uint_fast8_t format = 0; format < 4; format++) {
+        for (size_t i = 0; i < size_count; i++) {
+            if (SUCCESS != bench_generate(&inputs[loaded], format, sizes[i][0], sizes[i][1])) {
+                fprintf(stderr, "couldn't generate %s image\n", pixel_formats[format]);
+                return OUT_OF_MEMORY_ERROR;
+            }
+            loaded++;
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        if (SUCCESS != bench_load(&inputs[loaded], argv[i])) {
+            fprintf(stderr, "couldn't read %s\n", argv[i]);
+            return READ_ERROR;
+        }
+        loaded++;
+    }
+
+    printf(
+        "{\n  \"strength\": %u,\n  \"bleed_divider\": %u,\n  \"runs\": %lu,\n  \"zlib\": \"%s\",\n  \"efforts\": [",
+        (unsigned int)options.quantization_strength,
+        (unsigned int)options.bleed_divider, runs,
+        deflate == &rwpng_deflate_latency ? "latency" : "max"
+    );
+
+    int retval = SUCCESS;
+    bool first = true;
+    for (int effort = optimize_effort_fast; effort <= optimize_effort_exhaustive; effort++) {
+        if (all_efforts || effort == (int)options.effort) {
+            options.effort = effort;
+            int effort_retval = bench_effort(inputs, input_count, &options, deflate, runs, first);
+            if (SUCCESS != effort_retval) {
+                retval = effort_retval;
+            }
+            first = false;
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    for (size_t i = 0; i < input_count; i++) {
+        free(inputs[i].png);
+    }
+    free(inputs);
+    memory_arena_destroy(&arena);
+
+    return retval;
+}
@@ -0,0 +1,106 @@
+/**
+ © 2020 William MacKay.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ See the GNU General Public License for more details:
+ <http://www.gnu.org/copyleft/gpl.html>
+*/
+
+#include "band_index.h"
+
+// nodes 1 to 255 are internal, node 256 + symbol is that symbol's leaf
+static inline unsigned char band_index_winner(const band_index *index, uint_fast16_t node) {
+    return node >= 256 ? (unsigned char)(node - 256) : index->winners[node];
+}
+
+// left is always the earlier symbol, so it keeps ties
+static inline unsigned char band_index_better(
+    const band_index *index, unsigned char left, unsigned char right
+) {
+    return index->keys[left] >= index->keys[right] ? left : right;
+}
+
+void band_index_init(
+    band_index *index, const uint32_t *frequency, const uint32_t *original_frequency
+) {
+    for (uint_fast16_t symbol = 0; symbol < 256; symbol++) {
+        index->keys[symbol] = (uint64_t)frequency[symbol] << 32 | original_frequency[symbol];
+    }
+    for (uint_fast16_t node = 255; node > 0; node--) {
+        index->winners[node] = band_index_better(
+            index, band_index_winner(index, 2 * node), band_index_winner(index, 2 * node + 1)
+        );
+    }
+}
+
+void band_index_add(band_index *index, unsigned char symbol, uint32_t count) {
+    index->keys[symbol] += (uint64_t)count << 32;
+    for (uint_fast16_t node = (256 + symbol) / 2; node > 0; node /= 2) {
+        index->winners[node] = band_index_better(
+            index, band_index_winner(index, 2 * node), band_index_winner(index, 2 * node + 1)
+        );
+    }
+}
+
+// best symbol from first to last, both inclusive and first <= last
+static unsigned char band_index_query(
+    const band_index *index, uint_fast16_t first, uint_fast16_t last
+) {
+    uint_fast16_t left = first + 256, right = last + 257;
+    int_fast16_t left_best = -1, right_best = -1;
+    while (left < right) {
+        if (left & 1) {
+            unsigned char winner = band_index_winner(index, left++);
+            left_best = left_best < 0 ? winner : band_index_better(index, left_best, winner);
+        }
+        if (right & 1) {
+            unsigned char winner = band_index_winner(index, --right);
+            right_best = right_best < 0 ? winner : band_index_better(index, winner, right_best);
+        }
+        left /= 2;
+        right /= 2;
+    }
+    if (left_best < 0) {
+        return right_best;
+    }
+    if (right_best < 0) {
+        return left_best;
+    }
+    return band_index_better(index, left_best, right_best);
+}
+
+// Finds the best symbol from min to max, signed and at most 256 apart,
+// returning it in the same signed range. Ties go to preferred when it is
+// one of them and otherwise to the lowest symbol, as in a scan from min
+// up to max that only replaces its best symbol when beaten or by the
+// preferred one.
+int_fast16_t band_index_best(
+    const band_index *index, int_fast16_t min, int_fast16_t max,
+    int_fast16_t preferred
+) {
+    uint_fast16_t first = (unsigned char)min;
+    uint_fast16_t length = max - min + 1;
+
+    // a band wrapping past a multiple of 256 is two runs of bytes, the
+    // first of which comes before the second
+    unsigned char best;
+    if (first + length <= 256) {
+        best = band_index_query(index, first, first + length - 1);
+    } else {
+        unsigned char before = band_index_query(index, first, 255);
+        unsigned char after = band_index_query(index, 0, first + length - 257);
+        best = index->keys[before] >= index->keys[after] ? before : after;
+    }
+
+    if (preferred >= min && preferred <= max && index->keys[(unsigned char)preferred] == index->keys[best]) {
+        return preferred;
+    }
+    return min + (unsigned char)(best - first);
+}
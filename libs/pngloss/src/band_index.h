@@ -0,0 +1,28 @@
+#ifndef BAND_INDEX_H
+#define BAND_INDEX_H
+
+#include <stdint.h>
+
+// data structures
+
+// A tournament tree over the 256 symbols, answering which symbol in a band
+// is used most often. Each symbol's key is its frequency in the high half
+// and its frequency in the original image in the low half, so the larger
+// key is the better symbol just like in the linear scan. Internal node n
+// holds the best symbol under it, the earlier symbol winning ties.
+typedef struct {
+    uint64_t keys[256];
+    unsigned char winners[256];
+} band_index;
+
+// function prototypes
+void band_index_init(
+    band_index *index, const uint32_t *frequency, const uint32_t *original_frequency
+);
+void band_index_add(band_index *index, unsigned char symbol, uint32_t count);
+int_fast16_t band_index_best(
+    const band_index *index, int_fast16_t min, int_fast16_t max,
+    int_fast16_t preferred
+);
+
+#endif // BAND_INDEX_H
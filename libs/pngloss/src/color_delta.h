@@ -3,17 +3,224 @@
 
 #include <stdint.h>
 
+#if defined(__SSE2__) && !defined(PNGLOSS_NO_SIMD)
+#define COLOR_DELTA_SSE2
+#include <emmintrin.h>
+#endif
+
+// Colors and their differences are four 16 bit lanes, red, green, blue and
+// alpha, so each kernel below is one SSE2 operation on the low half of a
+// register. Without SSE2 they fall back to plain loops. Everything is
+// inline so the optimizer's per-pixel loop makes no calls and, with a
+// constant bytes_per_pixel, has no switch left either. Arithmetic wraps
+// at 16 bits just like storing into an int_least16_t does.
+
+// data structures
 typedef int_least16_t color_delta[4];
 typedef int_least16_t color_d2[4];
 
-void color_difference(
+#ifdef COLOR_DELTA_SSE2
+static inline __m128i color_delta_load(const int_least16_t *color) {
+    return _mm_loadl_epi64((const __m128i *)color);
+}
+
+static inline void color_delta_store(int_least16_t *color, __m128i value) {
+    _mm_storel_epi64((__m128i *)color, value);
+}
+
+static inline uint32_t color_delta_sum_squares(__m128i value) {
+    // lanes 4 to 7 were loaded as zero
+    __m128i squares = _mm_madd_epi16(value, value);
+    squares = _mm_add_epi32(squares, _mm_srli_si128(squares, 4));
+    return (uint32_t)_mm_cvtsi128_si32(squares);
+}
+
+// truncating division of four 32 bit lanes, exact for 24 bit numerators
+static inline __m128i color_delta_divide(__m128i value, float divider) {
+    return _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(value), _mm_set1_ps(divider)));
+}
+
+// truncating division by 2 to the power of shift, like C division
+static inline __m128i color_delta_divide_pow2(__m128i value, int shift) {
+    __m128i bias = _mm_srli_epi32(_mm_srai_epi32(value, 31), 32 - shift);
+    return _mm_srai_epi32(_mm_add_epi32(value, bias), shift);
+}
+
+static inline void color_delta_add(color_delta *target, __m128i value) {
+    color_delta_store(*target, _mm_add_epi16(color_delta_load(*target), value));
+}
+#endif
+
+// Difference between two pixels of bytes_per_pixel channels, as red,
+// green, blue and alpha. Gray is copied into all three colors.
+static inline void color_difference(
     uint_fast8_t bytes_per_pixel, color_delta difference,
-    int_fast16_t *back_color, int_fast16_t *here_color
-);
-void color_delta_difference(
+    const int_least16_t *back_color, const int_least16_t *here_color
+) {
+#ifdef COLOR_DELTA_SSE2
+    const __m128i colors = _mm_set_epi16(0, 0, 0, 0, 0, -1, -1, -1);
+    __m128i d = _mm_sub_epi16(color_delta_load(here_color), color_delta_load(back_color));
+    switch (bytes_per_pixel) {
+        case 1:
+            // grayscale
+            d = _mm_and_si128(_mm_shufflelo_epi16(d, _MM_SHUFFLE(3, 0, 0, 0)), colors);
+            break;
+        case 2:
+            // gray + alpha
+            d = _mm_shufflelo_epi16(d, _MM_SHUFFLE(1, 0, 0, 0));
+            break;
+        case 3:
+            // rgb
+            d = _mm_and_si128(d, colors);
+            break;
+    }
+    color_delta_store(difference, d);
+#else
+    int_fast16_t d;
+    switch (bytes_per_pixel) {
+        case 1:
+            // grayscale
+            d = here_color[0] - back_color[0];
+            difference[0] = d;
+            difference[1] = d;
+            difference[2] = d;
+            difference[3] = 0;
+            break;
+        case 2:
+            // gray + alpha
+            d = here_color[0] - back_color[0];
+            difference[0] = d;
+            difference[1] = d;
+            difference[2] = d;
+            difference[3] = here_color[1] - back_color[1];
+            break;
+        case 3:
+            // rgb
+            difference[0] = here_color[0] - back_color[0];
+            difference[1] = here_color[1] - back_color[1];
+            difference[2] = here_color[2] - back_color[2];
+            difference[3] = 0;
+            break;
+        case 4:
+            // rgba
+            difference[0] = here_color[0] - back_color[0];
+            difference[1] = here_color[1] - back_color[1];
+            difference[2] = here_color[2] - back_color[2];
+            difference[3] = here_color[3] - back_color[3];
+            break;
+    }
+#endif
+}
+
+static inline void color_delta_difference(
     color_delta back_delta, color_delta here_delta, color_d2 d2
-);
-uint32_t color_distance(color_delta difference);
-uint32_t color_delta_distance(color_d2 partial);
+) {
+#ifdef COLOR_DELTA_SSE2
+    color_delta_store(d2, _mm_sub_epi16(color_delta_load(here_delta), color_delta_load(back_delta)));
+#else
+    d2[0] = here_delta[0] - back_delta[0];
+    d2[1] = here_delta[1] - back_delta[1];
+    d2[2] = here_delta[2] - back_delta[2];
+    d2[3] = here_delta[3] - back_delta[3];
+#endif
+}
+
+static inline uint32_t color_distance(color_delta difference) {
+#ifdef COLOR_DELTA_SSE2
+    return color_delta_sum_squares(color_delta_load(difference));
+#else
+    uint32_t total = 0;
+    for (uint_fast8_t i = 0; i < 4; i++) {
+        total += difference[i] * difference[i];
+    }
+    return total;
+#endif
+}
+
+static inline uint32_t color_delta_distance(color_d2 partial) {
+#ifdef COLOR_DELTA_SSE2
+    return color_delta_sum_squares(color_delta_load(partial));
+#else
+    uint32_t total = 0;
+    for (uint_fast8_t i = 0; i < 4; i++) {
+        total += partial[i] * partial[i];
+    }
+    return total;
+#endif
+}
+
+// Sierra dithering: spreads difference, reduced by bleed_divider, from the
+// pixel at the middle of a five pixel window into the rest of its row and
+// the two rows below. Each row pointer is at the left end of the window.
+static inline void color_delta_diffuse(
+    color_delta difference, int_fast16_t bleed_divider,
+    color_delta *current_row, color_delta *next_row, color_delta *last_row
+) {
+#ifdef COLOR_DELTA_SSE2
+    // widen to 32 bits so the divisions can't overflow
+    __m128i d = color_delta_load(difference);
+    d = _mm_srai_epi32(_mm_unpacklo_epi16(d, d), 16);
+
+    // reduce color bleed
+    d = color_delta_divide(d, (float)bleed_divider);
+
+    __m128i twos = color_delta_divide_pow2(d, 4);
+    d = _mm_sub_epi32(d, _mm_slli_epi32(twos, 2));
+    __m128i threes = color_delta_divide_pow2(d, 3);
+    d = _mm_sub_epi32(d, _mm_slli_epi32(threes, 1));
+    __m128i fours = color_delta_divide(_mm_slli_epi32(d, 1), 9.0f);
+    d = _mm_sub_epi32(d, _mm_slli_epi32(fours, 1));
+    __m128i five = color_delta_divide_pow2(d, 1);
+    d = _mm_sub_epi32(d, five);
+
+    // every part is no larger than the difference, so packing can't saturate
+    twos = _mm_packs_epi32(twos, twos);
+    threes = _mm_packs_epi32(threes, threes);
+    fours = _mm_packs_epi32(fours, fours);
+    five = _mm_packs_epi32(five, five);
+    d = _mm_packs_epi32(d, d);
+
+    color_delta_add(&next_row[0], twos);
+    color_delta_add(&next_row[4], twos);
+    color_delta_add(&last_row[1], twos);
+    color_delta_add(&last_row[3], twos);
+    color_delta_add(&current_row[4], threes);
+    color_delta_add(&last_row[2], threes);
+    color_delta_add(&next_row[1], fours);
+    color_delta_add(&next_row[3], fours);
+    color_delta_add(&next_row[2], five);
+    color_delta_add(&current_row[3], d);
+#else
+    for (uint_fast8_t c = 0; c < 4; c++) {
+        int_fast16_t d = difference[c];
+
+        // reduce color bleed
+        d = d / bleed_divider;
+
+        int_fast16_t twos = d / 16;
+        d -= twos * 4;
+        next_row[0][c] += twos;
+        next_row[4][c] += twos;
+        last_row[1][c] += twos;
+        last_row[3][c] += twos;
+
+        int_fast16_t threes = d / 8;
+        d -= threes * 2;
+        current_row[4][c] += threes;
+        last_row[2][c] += threes;
+
+        int_fast16_t fours = d * 2/9;
+        d -= fours * 2;
+        next_row[1][c] += fours;
+        next_row[3][c] += fours;
+
+        int_fast16_t five = d / 2;
+        d -= five;
+        next_row[2][c] += five;
+
+        current_row[3][c] += d;
+    }
+#endif
+}
 
 #endif // COLOR_DELTA_H
@@ -0,0 +1,138 @@
+/**
+ © 2020 William MacKay.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ See the GNU General Public License for more details:
+ <http://www.gnu.org/copyleft/gpl.html>
+*/
+
+#include <stdlib.h>
+
+#include "libpngloss.h"
+#include "pngloss_image.h"
+#include "rwpng.h"
+
+void pngloss_compress_options_init(pngloss_compress_options *options) {
+    *options = (pngloss_compress_options){
+        .strength = 19,
+        .bleed_divider = 2,
+        .threads = 1,
+        .filter_threads = 1,
+        .strip = false,
+        .skip_if_larger = false,
+        .zlib_level = rwpng_deflate_max.level,
+        .zlib_strategy = rwpng_deflate_max.strategy,
+        .zlib_window_bits = rwpng_deflate_max.window_bits,
+        .zlib_mem_level = rwpng_deflate_max.mem_level,
+        .squeeze = false,
+        .effort = PNGLOSS_EFFORT_EXHAUSTIVE,
+        .clean_transparent = false
+    };
+}
+
+void pngloss_compress_options_latency(pngloss_compress_options *options) {
+    options->zlib_level = rwpng_deflate_latency.level;
+    options->zlib_strategy = rwpng_deflate_latency.strategy;
+    options->zlib_window_bits = rwpng_deflate_latency.window_bits;
+    options->zlib_mem_level = rwpng_deflate_latency.mem_level;
+}
+
+int pngloss_compress_buffer(
+    const void *in, size_t in_size, const pngloss_compress_options *options,
+    void **out, size_t *out_size
+) {
+    pngloss_compress_options defaults;
+    if (!options) {
+        pngloss_compress_options_init(&defaults);
+        options = &defaults;
+    }
+
+    *out = NULL;
+    *out_size = 0;
+
+    if (options->strength > 255 ||
+        options->bleed_divider < 1 || options->bleed_divider > 32767 ||
+        options->threads < 1 || options->threads > 256 ||
+        options->filter_threads < 1 || options->filter_threads > 5 ||
+        options->effort > PNGLOSS_EFFORT_EXHAUSTIVE ||
+        options->zlib_level > 9 || options->zlib_strategy > RWPNG_STRATEGY_FIXED ||
+        options->zlib_window_bits < 8 || options->zlib_window_bits > 15 ||
+        options->zlib_mem_level < 1 || options->zlib_mem_level > 9) {
+        return INVALID_ARGUMENT;
+    }
+
+    png24_image image = {.width=0};
+    pngloss_error retval = rwpng_read_image24_buffer(in, in_size, &image, options->strip, false);
+
+    // Unlike the command line, nothing needs the original pixels after
+    // optimizing, so the decoded image is optimized in place.
+    memory_arena arena;
+    memory_arena_init(&arena);
+    optimize_options optimize = {
+        .quantization_strength = options->strength,
+        .bleed_divider = options->bleed_divider,
+        .strip_threads = options->threads,
+        .filter_threads = options->filter_threads,
+        .effort = options->effort == PNGLOSS_EFFORT_FAST ? optimize_effort_fast :
+            options->effort == PNGLOSS_EFFORT_MEDIUM ? optimize_effort_medium :
+            optimize_effort_exhaustive,
+        .clean_transparent = options->clean_transparent,
+        .verbose = false,
+        .arena = &arena
+    };
+    unsigned char *row_filters = NULL;
+    if (SUCCESS == retval) {
+        size_t arena_size = optimize_arena_size(image.width, image.height, image.bytes_per_pixel ? image.bytes_per_pixel : 4, &optimize);
+        retval = memory_arena_reserve(&arena, arena_size + memory_arena_padded(image.height));
+    }
+    if (SUCCESS == retval) {
+        row_filters = memory_arena_alloc(&arena, image.height);
+        if (!row_filters) {
+            retval = OUT_OF_MEMORY_ERROR;
+        }
+    }
+
+    if (SUCCESS == retval) {
+        retval = optimize_native_rows(image.row_pointers, image.width, image.height, &image.bytes_per_pixel, row_filters, &optimize);
+    }
+
+    if (SUCCESS == retval) {
+        if (options->skip_if_larger) {
+            image.maximum_file_size = image.file_size - 1;
+        }
+
+        rwpng_deflate_options deflate = {
+            .level = (int)options->zlib_level,
+            .mem_level = (int)options->zlib_mem_level,
+            .window_bits = (int)options->zlib_window_bits,
+            .strategy = (rwpng_deflate_strategy)options->zlib_strategy
+        };
+        unsigned char *buffer;
+        size_t size;
+        if (options->squeeze) {
+            retval = rwpng_write_image24_smallest_buffer(&image, row_filters, rwpng_deflate_squeeze, rwpng_deflate_squeeze_count, &buffer, &size);
+        } else {
+            retval = rwpng_write_image24_buffer(&image, row_filters, &deflate, &buffer, &size);
+        }
+        if (SUCCESS == retval) {
+            *out = buffer;
+            *out_size = size;
+        }
+    }
+
+    rwpng_free_image24(&image);
+    memory_arena_destroy(&arena);
+
+    return retval;
+}
+
+void pngloss_free_buffer(void *buffer) {
+    free(buffer);
+}
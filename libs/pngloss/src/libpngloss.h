@@ -0,0 +1,68 @@
+#ifndef LIBPNGLOSS_H
+#define LIBPNGLOSS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// data structures
+
+// Settings for pngloss_compress_buffer, matching the command line options
+// of the same names. Start from pngloss_compress_options_init.
+typedef struct {
+    unsigned int strength;          // 0 to 255, default 19
+    unsigned int bleed_divider;     // 1 to 32767, default 2
+    unsigned int threads;           // strips optimized at once, 1 to 256
+    unsigned int filter_threads;    // filters tried at once, 1 to 5
+    bool strip;                     // remove optional metadata
+    bool skip_if_larger;            // fail rather than grow the file
+    unsigned int zlib_level;        // 0 to 9, default 9
+    unsigned int zlib_strategy;     // zlib's Z_*_STRATEGY, 0 to 4, default 1
+    unsigned int zlib_window_bits;  // 8 to 15, default 15
+    unsigned int zlib_mem_level;    // 1 to 9, default 9
+    bool squeeze;                   // keep the smallest of several zlib
+                                    // settings, ignoring the ones above
+    unsigned int effort;            // one of the PNGLOSS_EFFORT_* below
+    bool clean_transparent;         // don't keep invisible colors
+} pngloss_compress_options;
+
+// How hard to look for each row's filter, as with --effort. Fast tries the
+// one filter a heuristic picks, medium that and the row above's filter,
+// and exhaustive, the default, all five. Fast and medium also try the
+// filter that won most sampled rows, and can still make much larger files.
+#define PNGLOSS_EFFORT_FAST 0
+#define PNGLOSS_EFFORT_MEDIUM 1
+#define PNGLOSS_EFFORT_EXHAUSTIVE 2
+
+// function prototypes
+
+// the defaults, which write the smallest files
+void pngloss_compress_options_init(pngloss_compress_options *options);
+// Switches the zlib settings to the --zlib-preset latency ones, which write
+// several times faster for a few percent more bytes.
+void pngloss_compress_options_latency(pngloss_compress_options *options);
+
+// Lossily compresses the PNG file in in, which is in_size bytes long,
+// entirely in memory. Options may be NULL for the defaults. Returns 0 and
+// sets *out to a new PNG file of *out_size bytes, to be released with
+// pngloss_free_buffer, or returns the same nonzero code the pngloss
+// command would exit with and leaves *out NULL. 98 means the result
+// was larger than the input with skip_if_larger set.
+//
+// Nothing is shared between calls, so any number of threads may call
+// this at once.
+int pngloss_compress_buffer(
+    const void *in, size_t in_size, const pngloss_compress_options *options,
+    void **out, size_t *out_size
+);
+
+void pngloss_free_buffer(void *buffer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBPNGLOSS_H
@@ -0,0 +1,154 @@
+/**
+ © 2020 William MacKay.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ See the GNU General Public License for more details:
+ <http://www.gnu.org/copyleft/gpl.html>
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory_arena.h"
+
+// enough for SSE loads and anything malloc would align for
+#define memory_arena_alignment 16
+// blocks added when the arena runs out are at least this big
+static const size_t memory_arena_min_block = 64 * 1024;
+
+struct memory_arena_block {
+    memory_arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+// the header is padded so the data after it stays aligned
+static const size_t memory_arena_header =
+    (sizeof(memory_arena_block) + memory_arena_alignment - 1) &
+    ~(size_t)(memory_arena_alignment - 1);
+
+static memory_arena_block *memory_arena_block_create(size_t size) {
+    if (size > SIZE_MAX - memory_arena_header) {
+        return NULL;
+    }
+    memory_arena_block *block = malloc(memory_arena_header + size);
+    if (block) {
+        block->next = NULL;
+        block->size = size;
+        block->used = 0;
+    }
+    return block;
+}
+
+static void memory_arena_free_blocks(memory_arena *arena) {
+    memory_arena_block *block = arena->blocks;
+    while (block) {
+        memory_arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->capacity = 0;
+}
+
+void memory_arena_init(memory_arena *arena) {
+    pthread_mutex_init(&arena->mutex, NULL);
+    arena->blocks = NULL;
+    arena->capacity = 0;
+}
+
+// Makes sure the arena has a single block of at least size bytes. Only
+// call it when nothing is allocated, like right after a reset.
+pngloss_error memory_arena_reserve(memory_arena *arena, size_t size) {
+    if (arena->blocks && !arena->blocks->next && arena->blocks->size >= size) {
+        return SUCCESS;
+    }
+    memory_arena_free_blocks(arena);
+    arena->blocks = memory_arena_block_create(size);
+    if (!arena->blocks) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+    arena->capacity = size;
+    return SUCCESS;
+}
+
+// Returns size bytes that stay valid until the next reset, or NULL when
+// out of memory. The contents are left over from earlier images.
+void *memory_arena_alloc(memory_arena *arena, size_t size) {
+    if (size > SIZE_MAX - memory_arena_alignment) {
+        return NULL;
+    }
+    size = memory_arena_padded(size);
+
+    pthread_mutex_lock(&arena->mutex);
+    // only the newest block, at the front, has room left worth using
+    memory_arena_block *block = arena->blocks;
+    if (!block || block->size - block->used < size) {
+        size_t block_size = size > memory_arena_min_block ? size : memory_arena_min_block;
+        if (arena->capacity > block_size) {
+            // grow geometrically so a big image doesn't take many blocks
+            block_size = arena->capacity;
+        }
+        block = memory_arena_block_create(block_size);
+        if (block) {
+            block->next = arena->blocks;
+            arena->blocks = block;
+            arena->capacity += block_size;
+        }
+    }
+    void *pointer = NULL;
+    if (block) {
+        pointer = (unsigned char *)block + memory_arena_header + block->used;
+        block->used += size;
+    }
+    pthread_mutex_unlock(&arena->mutex);
+
+    return pointer;
+}
+
+void *memory_arena_calloc(memory_arena *arena, size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    void *pointer = memory_arena_alloc(arena, count * size);
+    if (pointer) {
+        memset(pointer, 0, count * size);
+    }
+    return pointer;
+}
+
+// How much of the arena an allocation of size bytes takes, for sizing it
+// with memory_arena_reserve.
+size_t memory_arena_padded(size_t size) {
+    return (size + memory_arena_alignment - 1) & ~(size_t)(memory_arena_alignment - 1);
+}
+
+// Gives back everything allocated, keeping the memory for the next image.
+// If the last image needed more than one block they're merged into one.
+void memory_arena_reset(memory_arena *arena) {
+    memory_arena_block *block = arena->blocks;
+    if (block && block->next) {
+        size_t capacity = arena->capacity;
+        memory_arena_free_blocks(arena);
+        // if this fails the next image just starts out with no blocks
+        arena->blocks = memory_arena_block_create(capacity);
+        if (arena->blocks) {
+            arena->capacity = capacity;
+        }
+    } else if (block) {
+        block->used = 0;
+    }
+}
+
+void memory_arena_destroy(memory_arena *arena) {
+    memory_arena_free_blocks(arena);
+    pthread_mutex_destroy(&arena->mutex);
+}
@@ -0,0 +1,34 @@
+#ifndef MEMORY_ARENA_H
+#define MEMORY_ARENA_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "rwpng.h"
+
+// data structures
+
+// Scratch memory owned by one job and reused from image to image. Memory
+// is handed out by bumping a pointer and only given back all at once by
+// memory_arena_reset. When a block runs out another is added, and a reset
+// merges them into one block big enough for everything, so after the first
+// image a job usually sets up each image without calling malloc.
+// Allocating takes a lock so strips can set themselves up at once.
+typedef struct memory_arena_block memory_arena_block;
+typedef struct {
+    pthread_mutex_t mutex;
+    memory_arena_block *blocks;
+    // total size of all blocks
+    size_t capacity;
+} memory_arena;
+
+// function prototypes
+void memory_arena_init(memory_arena *arena);
+pngloss_error memory_arena_reserve(memory_arena *arena, size_t size);
+void *memory_arena_alloc(memory_arena *arena, size_t size);
+void *memory_arena_calloc(memory_arena *arena, size_t count, size_t size);
+size_t memory_arena_padded(size_t size);
+void memory_arena_reset(memory_arena *arena);
+void memory_arena_destroy(memory_arena *arena);
+
+#endif // MEMORY_ARENA_H
@@ -15,121 +15,470 @@
 */
 
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "optimize_state.h"
 
 const uint_fast8_t dither_row_count = 3;
 const uint_fast8_t dither_filter_width = 5;
 const uint_fast16_t symbol_count = 256;
+// narrower bands are faster to scan than to look up in a band_index
+const int_fast16_t band_index_min_width = 32;
+
+#if defined(__GNUC__)
+#define PNGLOSS_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define PNGLOSS_ALWAYS_INLINE inline
+#endif
+
+// Arena memory optimize_state_init takes for an image this wide.
+size_t optimize_state_arena_size(uint32_t width, bool own_histograms) {
+    uint32_t error_width = width + dither_filter_width;
+    size_t size = memory_arena_padded((size_t)(dither_row_count - 1) * error_width * sizeof(color_delta)) +
+        memory_arena_padded(symbol_count * sizeof(uint32_t)) +
+        memory_arena_padded(5 * sizeof(band_index)) +
+        memory_arena_padded(sizeof(quantization_bands));
+    if (own_histograms) {
+        size += memory_arena_padded(5 * symbol_count * sizeof(uint32_t));
+    }
+    return size;
+}
 
 pngloss_error optimize_state_init(
-    optimize_state *state, pngloss_image *image
+    optimize_state *state, pngloss_image *image,
+    uint32_t *const original_frequency[5], memory_arena *arena
 ) {
-    state->x = 0;
     state->y = 0;
     state->symbol_count = 0;
 
-    // clear values in case we return early and later free uninitialized pointers
-    state->pixels = NULL;
+    // clear values in case we return early
     state->color_error = NULL;
     state->symbol_frequency = NULL;
+    state->original_frequency_table = NULL;
+    state->band_indexes = NULL;
+    state->bands = NULL;
     for (uint_fast8_t filter = 0; filter < 5; filter++) {
         state->original_frequency[filter] = NULL;
     }
 
-    state->pixels = calloc((size_t)image->width, image->bytes_per_pixel);
-    if (!state->pixels) {
-        return OUT_OF_MEMORY_ERROR;
-    }
-
+    // error carried into the current row and the row below it
     uint32_t error_width = image->width + dither_filter_width;
-    state->color_error = calloc((size_t)dither_row_count * error_width, sizeof(color_delta));
+    state->color_error = memory_arena_calloc(arena, (size_t)(dither_row_count - 1) * error_width, sizeof(color_delta));
     if (!state->color_error) {
         return OUT_OF_MEMORY_ERROR;
     }
 
-    state->symbol_frequency = calloc(symbol_count, sizeof(uint32_t));
+    state->symbol_frequency = memory_arena_calloc(arena, symbol_count, sizeof(uint32_t));
     if (!state->symbol_frequency) {
         return OUT_OF_MEMORY_ERROR;
     }
 
-    for (uint_fast8_t i = 0; i < 5; i++) {
-        state->original_frequency[i] = calloc(symbol_count, sizeof(uint32_t));
-        if (!state->original_frequency[i]) {
+    if (original_frequency) {
+        // histograms were counted over a larger image by the caller, who
+        // keeps them alive and unchanged while this state is used
+        for (uint_fast8_t filter = 0; filter < 5; filter++) {
+            state->original_frequency[filter] = original_frequency[filter];
+        }
+    } else {
+        state->original_frequency_table = memory_arena_calloc(arena, 5 * symbol_count, sizeof(uint32_t));
+        if (!state->original_frequency_table) {
             return OUT_OF_MEMORY_ERROR;
         }
+        for (uint_fast8_t filter = 0; filter < 5; filter++) {
+            state->original_frequency[filter] = state->original_frequency_table + filter * symbol_count;
+        }
+        original_frequency_count(state->original_frequency, image);
     }
 
+    // nothing has been used yet, so only the original image breaks ties
+    state->band_indexes = memory_arena_alloc(arena, 5 * sizeof(band_index));
+    if (!state->band_indexes) {
+        return OUT_OF_MEMORY_ERROR;
+    }
     for (uint_fast8_t filter = 0; filter < 5; filter++) {
-        for (uint32_t y = 0; y < image->height; y++) {
-            for (uint32_t x = 0; x < image->width; x++) {
-                for (uint32_t c = 0; c < image->bytes_per_pixel; c++) {
-                    uint32_t offset = x*image->bytes_per_pixel + c;
-                    unsigned char color = image->rows[y][offset];
-                    unsigned char left = 0;
-                    if (x > 0) {
-                        left = image->rows[y][offset-image->bytes_per_pixel];
-                    }
-                    unsigned char predicted = filter_predict(image, x, y, filter, c, left);
-                    unsigned char filtered = color - predicted;
-                    //fprintf(stderr, "color %d predicted %d filtered %d\n", (int)color, (int)predicted, (int)filtered);
-                    state->original_frequency[filter][filtered]++;
-                }
+        band_index_init(&state->band_indexes[filter], state->symbol_frequency, state->original_frequency[filter]);
+    }
+
+    // built for a strength by the first optimize_state_set_strength
+    state->bands = memory_arena_alloc(arena, sizeof(quantization_bands));
+    if (!state->bands) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+    state->bands->strength = -1;
+
+    return SUCCESS;
+}
+
+// Builds the bands for the strength rows are about to be tried at, unless
+// they're already built for it. Only call this while no trials are running.
+void optimize_state_set_strength(
+    optimize_state *state, uint_fast8_t quantization_strength
+) {
+    quantization_bands *bands = state->bands;
+    if (bands->strength == quantization_strength) {
+        return;
+    }
+    bands->strength = quantization_strength;
+    for (int_fast16_t filtered = -quantization_band_limit; filtered <= quantization_band_limit; filtered++) {
+        int_fast16_t min;
+        if (filtered < 0) {
+            int_fast16_t max = -(-filtered - (-filtered % (quantization_strength + 1)));
+            min = max - quantization_strength;
+        } else {
+            min = filtered - (filtered % (quantization_strength + 1));
+        }
+        bands->min[filtered + quantization_band_limit] = min;
+    }
+}
+
+// Counts one byte of the original image under every filter at once.
+static inline void original_frequency_add(
+    uint32_t *const original_frequency[5], unsigned char color,
+    unsigned char above, unsigned char diag, unsigned char left
+) {
+    original_frequency[pngloss_none][color]++;
+    original_frequency[pngloss_sub][(unsigned char)(color - left)]++;
+    original_frequency[pngloss_up][(unsigned char)(color - above)]++;
+    original_frequency[pngloss_average][(unsigned char)(color - pngloss_filter_average(above, diag, left))]++;
+    original_frequency[pngloss_paeth][(unsigned char)(color - pngloss_filter_paeth(above, diag, left))]++;
+}
+
+#ifdef __SSE2__
+// Filters 16 bytes of the original image every way at once. The caller
+// counts the results, since SSE2 has no scatter.
+static inline void original_frequency_filter16(
+    const unsigned char *row, const unsigned char *above_row,
+    uint32_t offset, uint32_t bytes_per_pixel, unsigned char filtered[5][16]
+) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i color = _mm_loadu_si128((const __m128i *)(row + offset));
+    __m128i left = _mm_loadu_si128((const __m128i *)(row + offset - bytes_per_pixel));
+    __m128i above = zero, diag = zero;
+    if (above_row) {
+        above = _mm_loadu_si128((const __m128i *)(above_row + offset));
+        diag = _mm_loadu_si128((const __m128i *)(above_row + offset - bytes_per_pixel));
+    }
+
+    // floor((left + above) / 2) without widening
+    __m128i average = _mm_sub_epi8(
+        _mm_avg_epu8(left, above),
+        _mm_and_si128(_mm_xor_si128(left, above), one)
+    );
+
+    // paeth needs signed 16 bit differences, so do each half separately
+    __m128i paeth[2];
+    for (uint_fast8_t half = 0; half < 2; half++) {
+        __m128i a = half ? _mm_unpackhi_epi8(left, zero) : _mm_unpacklo_epi8(left, zero);
+        __m128i b = half ? _mm_unpackhi_epi8(above, zero) : _mm_unpacklo_epi8(above, zero);
+        __m128i c = half ? _mm_unpackhi_epi8(diag, zero) : _mm_unpacklo_epi8(diag, zero);
+        __m128i p = _mm_sub_epi16(b, c);
+        __m128i p_diag = _mm_sub_epi16(a, c);
+        __m128i p_sum = _mm_add_epi16(p, p_diag);
+        __m128i p_left = _mm_max_epi16(p, _mm_sub_epi16(zero, p));
+        __m128i p_above = _mm_max_epi16(p_diag, _mm_sub_epi16(zero, p_diag));
+        p_diag = _mm_max_epi16(p_sum, _mm_sub_epi16(zero, p_sum));
+
+        // left unless beaten by above or diag, then above unless beaten by diag
+        __m128i not_left = _mm_or_si128(
+            _mm_cmpgt_epi16(p_left, p_above), _mm_cmpgt_epi16(p_left, p_diag)
+        );
+        __m128i use_diag = _mm_cmpgt_epi16(p_above, p_diag);
+        __m128i other = _mm_or_si128(_mm_and_si128(use_diag, c), _mm_andnot_si128(use_diag, b));
+        paeth[half] = _mm_or_si128(_mm_and_si128(not_left, other), _mm_andnot_si128(not_left, a));
+    }
+    __m128i paeth_predicted = _mm_packus_epi16(paeth[0], paeth[1]);
+
+    _mm_storeu_si128((__m128i *)filtered[pngloss_none], color);
+    _mm_storeu_si128((__m128i *)filtered[pngloss_sub], _mm_sub_epi8(color, left));
+    _mm_storeu_si128((__m128i *)filtered[pngloss_up], _mm_sub_epi8(color, above));
+    _mm_storeu_si128((__m128i *)filtered[pngloss_average], _mm_sub_epi8(color, average));
+    _mm_storeu_si128((__m128i *)filtered[pngloss_paeth], _mm_sub_epi8(color, paeth_predicted));
+}
+#endif
+
+// Counts one row of the original image into every filter's histogram,
+// computing the predictions inline instead of through filter_predict.
+// above_row is NULL for the first row.
+void original_frequency_count_row(
+    uint32_t *const original_frequency[5], const unsigned char *row,
+    const unsigned char *above_row, uint32_t width, uint_fast8_t bytes_per_pixel
+) {
+    uint32_t row_bytes = width * bytes_per_pixel;
+
+    // the first pixel has nothing to its left
+    uint32_t offset = 0;
+    for (; offset < bytes_per_pixel && offset < row_bytes; offset++) {
+        unsigned char above = above_row ? above_row[offset] : 0;
+        original_frequency_add(original_frequency, row[offset], above, 0, 0);
+    }
+
+#ifdef __SSE2__
+    unsigned char filtered[5][16];
+    for (; offset + 16 <= row_bytes; offset += 16) {
+        original_frequency_filter16(row, above_row, offset, bytes_per_pixel, filtered);
+        for (uint_fast8_t filter = 0; filter < 5; filter++) {
+            uint32_t *frequency = original_frequency[filter];
+            for (uint_fast8_t i = 0; i < 16; i++) {
+                frequency[filtered[filter][i]]++;
             }
         }
     }
+#endif
 
-    return SUCCESS;
+    for (; offset < row_bytes; offset++) {
+        unsigned char above = 0, diag = 0;
+        if (above_row) {
+            above = above_row[offset];
+            diag = above_row[offset - bytes_per_pixel];
+        }
+        original_frequency_add(
+            original_frequency, row[offset], above, diag, row[offset - bytes_per_pixel]
+        );
+    }
 }
 
-void optimize_state_destroy(optimize_state *state) {
-    free(state->pixels);
-    free(state->color_error);
-    free(state->symbol_frequency);
-    for (uint_fast8_t filter = 0; filter < 5; filter++) {
-        free(state->original_frequency[filter]);
+// Counts every filter's histogram of the original image in one pass over
+// the rows.
+void original_frequency_count(
+    uint32_t *const original_frequency[5], pngloss_image *image
+) {
+    for (uint32_t y = 0; y < image->height; y++) {
+        original_frequency_count_row(
+            original_frequency, image->rows[y], y > 0 ? image->rows[y-1] : NULL,
+            image->width, image->bytes_per_pixel
+        );
     }
 }
 
-void optimize_state_copy(
-    optimize_state *to,
-    optimize_state *from,
-    pngloss_image *image
+// Arena memory optimize_trial_init takes for an image this wide.
+size_t optimize_trial_arena_size(uint32_t width, uint_fast8_t bytes_per_pixel) {
+    uint32_t error_width = width + dither_filter_width;
+    return memory_arena_padded((size_t)width * bytes_per_pixel) +
+        memory_arena_padded((size_t)dither_row_count * error_width * sizeof(color_delta)) +
+        memory_arena_padded(symbol_count * sizeof(uint32_t)) +
+        memory_arena_padded(symbol_count * sizeof(unsigned char)) +
+        memory_arena_padded(sizeof(band_index));
+}
+
+pngloss_error optimize_trial_init(
+    optimize_trial *trial, optimize_state *state, pngloss_image *image,
+    memory_arena *arena
 ) {
-    to->x = from->x;
-    to->y = from->y;
+    trial->state = state;
+    trial->x = 0;
+    trial->touched_count = 0;
+
+    // clear values in case we return early
+    trial->pixels = NULL;
+    trial->color_error = NULL;
+    trial->symbol_frequency = NULL;
+    trial->touched_symbols = NULL;
+    trial->band_index = NULL;
+
+    trial->pixels = memory_arena_calloc(arena, (size_t)image->width, image->bytes_per_pixel);
+    if (!trial->pixels) {
+        return OUT_OF_MEMORY_ERROR;
+    }
 
-    memcpy(to->pixels, from->pixels, (size_t)image->width * image->bytes_per_pixel);
+    uint32_t error_width = image->width + dither_filter_width;
+    trial->color_error = memory_arena_calloc(arena, (size_t)dither_row_count * error_width, sizeof(color_delta));
+    if (!trial->color_error) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    trial->symbol_frequency = memory_arena_calloc(arena, symbol_count, sizeof(uint32_t));
+    if (!trial->symbol_frequency) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    trial->touched_symbols = memory_arena_calloc(arena, symbol_count, sizeof(unsigned char));
+    if (!trial->touched_symbols) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    trial->band_index = memory_arena_alloc(arena, sizeof(band_index));
+    if (!trial->band_index) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    return SUCCESS;
+}
+
+void optimize_trial_begin(optimize_trial *trial, pngloss_image *image) {
+    trial->x = 0;
+    for (uint_fast8_t c = 0; c < 4; c++) {
+        trial->last_choice[c].valid = false;
+    }
 
+    // forget symbols counted by the previous attempt
+    for (uint_fast16_t i = 0; i < trial->touched_count; i++) {
+        trial->symbol_frequency[trial->touched_symbols[i]] = 0;
+    }
+    trial->touched_count = 0;
+
+    // Error rows are cleared just ahead of the current pixel as the row is
+    // optimized, so only the start of each row needs clearing here.
+    uint32_t error_width = image->width + dither_filter_width;
+    for (uint_fast8_t row = 0; row < dither_row_count; row++) {
+        memset(trial->color_error + row * error_width, 0, dither_filter_width * sizeof(color_delta));
+    }
+}
+
+void optimize_trial_commit(optimize_trial *trial, pngloss_image *image) {
+    optimize_state *state = trial->state;
+
+    for (uint_fast16_t i = 0; i < trial->touched_count; i++) {
+        unsigned char symbol = trial->touched_symbols[i];
+        state->symbol_frequency[symbol] += trial->symbol_frequency[symbol];
+        for (uint_fast8_t filter = 0; filter < 5; filter++) {
+            band_index_add(&state->band_indexes[filter], symbol, trial->symbol_frequency[symbol]);
+        }
+    }
+    state->symbol_count += (uintmax_t)image->width * image->bytes_per_pixel;
+
+    // move color errors up one row, adding what this row diffused
+    uint32_t error_width = image->width + dither_filter_width;
+    color_delta *current_row = state->color_error;
+    color_delta *next_row = state->color_error + error_width;
+    for (uint32_t x = 0; x < error_width; x++) {
+        for (uint_fast8_t c = 0; c < 4; c++) {
+            current_row[x][c] = next_row[x][c] + trial->color_error[error_width + x][c];
+        }
+    }
+    memcpy(next_row, trial->color_error + 2 * error_width, error_width * sizeof(color_delta));
+
+    state->y++;
+}
+
+static PNGLOSS_ALWAYS_INLINE void spread_color_error(
+    optimize_trial *trial, pngloss_image *image,
+    color_delta difference, int_fast16_t bleed_divider
+) {
     uint32_t error_width = image->width + dither_filter_width;
-    memcpy(to->color_error, from->color_error, (size_t)dither_row_count * error_width * sizeof(color_delta));
 
-    memcpy(to->symbol_frequency, from->symbol_frequency, (size_t)symbol_count * sizeof(uint32_t));
-    to->symbol_count = from->symbol_count;
+    // Clear error this trial hasn't written yet, just before the kernel
+    // below reaches it. The start of each row was cleared when the trial
+    // began.
+    for (uint_fast8_t row = 0; row < dither_row_count; row++) {
+        memset(trial->color_error[error_width * row + trial->x + dither_filter_width], 0, sizeof(color_delta));
+    }
+
+    color_delta_diffuse(
+        difference, bleed_divider,
+        trial->color_error + trial->x,
+        trial->color_error + error_width + trial->x,
+        trial->color_error + 2 * error_width + trial->x
+    );
+}
+
+void diffuse_color_error(
+    optimize_trial *trial, pngloss_image *image,
+    color_delta difference, int_fast16_t bleed_divider
+) {
+    spread_color_error(trial, image, difference, bleed_divider);
 }
 
-uintmax_t optimize_state_run(
-    optimize_state *state,
+// Tries writing the current row the same as the row above was written, all
+// zero symbols with the up filter, for a row identical to the original row
+// above. The error carried into the row and the error the copy makes are
+// diffused like in any trial, so committing it loses none.
+void optimize_trial_repeat_row(
+    optimize_trial *trial, pngloss_image *image, int_fast16_t bleed_divider
+) {
+    optimize_state *state = trial->state;
+    uint_fast8_t bytes_per_pixel = image->bytes_per_pixel;
+    const unsigned char *row = image->rows[state->y];
+    const unsigned char *above_row = image->rows[state->y - 1];
+
+    optimize_trial_begin(trial, image);
+    for (; trial->x < image->width; trial->x++) {
+        // all four lanes are loaded by the color_delta kernels
+        int_least16_t back_color[4] = {0};
+        int_least16_t here_color[4] = {0};
+        bool transparent = (bytes_per_pixel % 2) == 0 &&
+            row[trial->x*bytes_per_pixel+bytes_per_pixel-1] == 0;
+        for (uint_fast8_t c = 0; c < bytes_per_pixel; c++) {
+            uint32_t offset = trial->x*bytes_per_pixel + c;
+            trial->pixels[offset] = above_row[offset];
+            if (transparent && c == bytes_per_pixel - 1) {
+                // fully transparent alpha carries no error, see
+                // optimize_trial_pixel
+                continue;
+            }
+            uint_fast8_t i = (bytes_per_pixel == 2 && c == 1) ? 3 : c;
+            back_color[c] = above_row[offset];
+            here_color[c] = row[offset] + state->color_error[trial->x+dither_filter_width/2][i] + trial->color_error[trial->x+dither_filter_width/2][i];
+        }
+
+        color_delta difference;
+        color_difference(bytes_per_pixel, difference, back_color, here_color);
+        spread_color_error(trial, image, difference, bleed_divider);
+    }
+
+    trial->symbol_frequency[0] = image->width * bytes_per_pixel;
+    trial->touched_symbols[0] = 0;
+    trial->touched_count = 1;
+}
+
+// Predicts a byte from its neighbors. Kernels below pass a constant filter,
+// so the switch disappears once this is inlined.
+static PNGLOSS_ALWAYS_INLINE unsigned char predict(
+    pngloss_filter filter, unsigned char above, unsigned char diag, unsigned char left
+) {
+    switch (filter) {
+        case pngloss_sub:
+            return pngloss_filter_sub(above, diag, left);
+        case pngloss_up:
+            return pngloss_filter_up(above, diag, left);
+        case pngloss_average:
+            return pngloss_filter_average(above, diag, left);
+        case pngloss_paeth:
+            return pngloss_filter_paeth(above, diag, left);
+        default:
+            return pngloss_filter_none(above, diag, left);
+    }
+}
+
+// Optimizes one pixel of the current row. Both the filter and the pixel
+// size are parameters so kernels can be generated for each combination,
+// letting the compiler unroll the channel loop and drop the branches on
+// gray+alpha and transparency that don't apply.
+static PNGLOSS_ALWAYS_INLINE uintmax_t optimize_trial_pixel(
+    optimize_trial *trial,
     pngloss_image *image,
     unsigned char *last_row_pixels,
     pngloss_filter filter,
+    uint_fast8_t bytes_per_pixel,
     uint_fast8_t quantization_strength,
-    int_fast16_t bleed_divider
+    int_fast16_t bleed_divider,
+    bool indexed,
+    const uint_least8_t *min_symbol_cost,
+    uintmax_t *symbol_cost
 ) {
-    int_fast16_t back_color[4];
-    int_fast16_t here_color[4];
-    int_fast16_t original_color[4];
-    int_fast16_t old_above_color[4];
-    int_fast16_t new_above_color[4];
-    int_fast16_t old_diag_color[4];
-    int_fast16_t new_diag_color[4];
-    int_fast16_t old_left_color[4];
-    int_fast16_t new_left_color[4];
-    for (uint_fast8_t c = 0; c < image->bytes_per_pixel; c++) {
-        uint32_t offset = state->x*image->bytes_per_pixel + c;
+    optimize_state *state = trial->state;
+    // all four lanes are loaded by the color_delta kernels
+    int_least16_t back_color[4] = {0};
+    int_least16_t here_color[4] = {0};
+    int_least16_t original_color[4] = {0};
+    int_least16_t old_above_color[4] = {0};
+    int_least16_t new_above_color[4] = {0};
+    int_least16_t old_diag_color[4] = {0};
+    int_least16_t new_diag_color[4] = {0};
+    int_least16_t old_left_color[4] = {0};
+    int_least16_t new_left_color[4] = {0};
+    unsigned char symbols[4];
+    bool transparent = (bytes_per_pixel % 2) == 0 &&
+        image->rows[state->y][trial->x*bytes_per_pixel+bytes_per_pixel-1] == 0;
+    for (uint_fast8_t c = 0; c < bytes_per_pixel; c++) {
+        uint32_t offset = trial->x*bytes_per_pixel + c;
         original_color[c] = image->rows[state->y][offset];
 
         uint_fast8_t i = c;
@@ -137,14 +486,14 @@ uintmax_t optimize_state_run(
         if (state->y > 0) {
             above = image->rows[state->y - 1][offset];
             old_above = last_row_pixels[offset];
-            if (state->x > 0) {
-                diag = image->rows[state->y - 1][offset - image->bytes_per_pixel];
-                old_diag = last_row_pixels[offset - image->bytes_per_pixel];
+            if (trial->x > 0) {
+                diag = image->rows[state->y - 1][offset - bytes_per_pixel];
+                old_diag = last_row_pixels[offset - bytes_per_pixel];
             }
         }
-        if (state->x > 0) {
-            left = state->pixels[offset - image->bytes_per_pixel];
-            old_left = image->rows[state->y][offset - image->bytes_per_pixel];
+        if (trial->x > 0) {
+            left = trial->pixels[offset - bytes_per_pixel];
+            old_left = image->rows[state->y][offset - bytes_per_pixel];
         }
         old_above_color[c] = old_above;
         new_above_color[c] = above;
@@ -153,24 +502,26 @@ uintmax_t optimize_state_run(
         old_left_color[c] = old_left;
         new_left_color[c] = left;
 
-        unsigned char best_symbol;
-        int_fast16_t predicted = filter_predict(image, state->x, state->y, filter, c, left);
-        if ((image->bytes_per_pixel % 2) == 0 && image->rows[state->y][state->x*image->bytes_per_pixel+image->bytes_per_pixel-1] == 0 && c == image->bytes_per_pixel - 1) {
-        //if ((image->bytes_per_pixel % 2) == 0 && image->rows[state->y][state->x*image->bytes_per_pixel+image->bytes_per_pixel-1] == 0) {
+        unsigned char best_symbol = 0;
+        int_fast16_t predicted = predict(filter, above, diag, left);
+        if (transparent && c == bytes_per_pixel - 1) {
             // leave fully transparent pixels fully transparent, symbol
             // is expensive but artifacts are unacceptable otherwise
             here_color[c] = 0;
             back_color[c] = 0;
             best_symbol = 0 - predicted;
+            trial->last_choice[c].valid = false;
         } else {
             // convert from pixel index to color delta index
-            if (image->bytes_per_pixel == 2 && c == 1) {
+            if (bytes_per_pixel == 2 && c == 1) {
                 // pixel alpha and color delta alpha are at different
                 // indexes when colorspace is gray+alpha
                 i = 3;
             }
-            int_fast16_t color_error = state->color_error[state->x+dither_filter_width/2][i];
-            here_color[c] = original_color[c] + color_error;
+            // error carried from rows above plus error diffused by this trial
+            int_least16_t color_error = state->color_error[trial->x+dither_filter_width/2][i] + trial->color_error[trial->x+dither_filter_width/2][i];
+            int_fast16_t here = original_color[c] + color_error;
+            here_color[c] = here;
 
             int_fast16_t original_symbol = original_color[c] - predicted;
             if (original_symbol < -128) {
@@ -180,18 +531,19 @@ uintmax_t optimize_state_run(
                 predicted += 256;
                 original_symbol = original_color[c] - predicted;
             }
-            int_fast16_t filtered = here_color[c] - predicted;
-
-            // Find assigned band of values for filtered.
-            int_fast16_t min, max;
-            if (filtered < 0) {
-                max = -(-filtered - (-filtered % (quantization_strength + 1)));
-                min = max - quantization_strength;
-            } else {
-                min = filtered - (filtered % (quantization_strength + 1));
-                max = min + quantization_strength;
+            int_fast16_t filtered = here - predicted;
+
+            // Find assigned band of values for filtered. Past the limit
+            // the band is clamped to one color below either way.
+            int_fast16_t band = filtered;
+            if (band < -quantization_band_limit) {
+                band = -quantization_band_limit;
+            } else if (band > quantization_band_limit) {
+                band = quantization_band_limit;
             }
-                
+            int_fast16_t min = state->bands->min[band + quantization_band_limit];
+            int_fast16_t max = min + quantization_strength;
+
             if (min + predicted < 0) {
                 min = 0 - predicted;
             }
@@ -209,77 +561,120 @@ uintmax_t optimize_state_run(
                 }
             }
 
-            bool found_best = false;
-            uint32_t best_frequency = 0;
-            for (int_fast16_t symbol = min; symbol <= max; symbol++) {
-                int_fast16_t back = symbol + predicted;
-                if (back < 0 || back > 255) {
-                    fprintf(stderr, "back %d min %d max %d\n", (int)back, (int)min, (int)max);
-                    abort();
-                }
-                bool new_best = false;
-                uint32_t frequency = state->symbol_frequency[(unsigned char)symbol];
+            // Flat areas search the same band pixel after pixel. The symbol
+            // chosen last time was the most frequent in the band and has
+            // been used once more since, so it's still the one to pick as
+            // long as nothing else in the band was used in between.
+            optimize_band_choice *last = &trial->last_choice[c];
+            bool repeat = last->valid && last->predicted == predicted &&
+                last->min == min && last->max == max &&
+                last->original_symbol == original_symbol;
+            for (uint_fast8_t k = c + 1; repeat && k < bytes_per_pixel; k++) {
+                unsigned char symbol = trial->last_symbols[k];
+                repeat = symbol == last->symbol || (unsigned char)(symbol - min) > max - min;
+            }
+            for (uint_fast8_t k = 0; repeat && k < c; k++) {
+                repeat = symbols[k] == last->symbol || (unsigned char)(symbols[k] - min) > max - min;
+            }
 
-                if (!found_best) {
-                    new_best = true;
-                } else if (best_frequency < frequency) {
-                    new_best = true;
-                } else if (best_frequency == frequency) {
-                    uint32_t best_close_freq = state->original_frequency[filter][best_symbol];
-                    uint32_t close_freq = state->original_frequency[filter][(unsigned char)symbol];
-                    if (best_close_freq < close_freq) {
+            if (repeat) {
+                best_symbol = last->symbol;
+                back_color[c] = (int_fast16_t)min + (unsigned char)(last->symbol - min) + predicted;
+            } else if (indexed && max - min + 1 >= band_index_min_width) {
+                int_fast16_t symbol = band_index_best(trial->band_index, min, max, original_symbol);
+                best_symbol = symbol;
+                back_color[c] = symbol + predicted;
+            } else {
+                bool found_best = false;
+                uint32_t best_frequency = 0;
+                for (int_fast16_t symbol = min; symbol <= max; symbol++) {
+                    int_fast16_t back = symbol + predicted;
+                    if (back < 0 || back > 255) {
+                        fprintf(stderr, "back %d min %d max %d\n", (int)back, (int)min, (int)max);
+                        abort();
+                    }
+                    bool new_best = false;
+                    uint32_t frequency = state->symbol_frequency[(unsigned char)symbol] + trial->symbol_frequency[(unsigned char)symbol];
+
+                    if (!found_best) {
+                        new_best = true;
+                    } else if (best_frequency < frequency) {
                         new_best = true;
-                    } else if (best_close_freq == close_freq) {
-                        if (symbol == original_symbol) {
+                    } else if (best_frequency == frequency) {
+                        uint32_t best_close_freq = state->original_frequency[filter][best_symbol];
+                        uint32_t close_freq = state->original_frequency[filter][(unsigned char)symbol];
+                        if (best_close_freq < close_freq) {
                             new_best = true;
+                        } else if (best_close_freq == close_freq) {
+                            if (symbol == original_symbol) {
+                                new_best = true;
+                            }
                         }
                     }
+                    if (new_best) {
+                        found_best = true;
+                        best_frequency = frequency;
+                        best_symbol = symbol;
+                        back_color[c] = back;
+                    }
                 }
-                if (new_best) {
-                    found_best = true;
-                    best_frequency = frequency;
-                    best_symbol = symbol;
-                    back_color[c] = back;
+                if (!found_best) {
+                    fprintf(stderr, "color %d min %d max %d\n", (int)back_color[c], (int)min, (int)max);
+                    abort();
                 }
             }
-            if (!found_best) {
-                fprintf(stderr, "color %d min %d max %d\n", (int)back_color[c], (int)min, (int)max);
-                abort();
-            }
+            *last = (optimize_band_choice){
+                .predicted = predicted,
+                .min = min,
+                .max = max,
+                .original_symbol = original_symbol,
+                .symbol = best_symbol,
+                .valid = true
+            };
         }
+        symbols[c] = best_symbol;
 
-        state->pixels[offset] = back_color[c];
+        trial->pixels[offset] = back_color[c];
 
-        state->symbol_frequency[best_symbol]++;
-        state->symbol_count++;
+        if (!trial->symbol_frequency[best_symbol]++) {
+            trial->touched_symbols[trial->touched_count++] = best_symbol;
+        }
+        if (indexed) {
+            band_index_add(trial->band_index, best_symbol, 1);
+        }
+        if (min_symbol_cost) {
+            *symbol_cost += min_symbol_cost[best_symbol];
+        }
     }
 
+    memcpy(trial->last_symbols, symbols, bytes_per_pixel);
+
     // spread color error from this pixel to nearby pixels
     color_delta difference;
-    color_difference(image->bytes_per_pixel, difference, back_color, here_color);
-    diffuse_color_error(state, image, difference, bleed_divider);
+    color_difference(bytes_per_pixel, difference, back_color, here_color);
+    spread_color_error(trial, image, difference, bleed_divider);
 
     // advance to next pixel
-    state->x++;
+    trial->x++;
 
     // calculate derivative error from three neighboring pixels to weight row cost
     color_delta old_partial_above, new_partial_above;
-    color_difference(image->bytes_per_pixel, old_partial_above, original_color, old_above_color);
-    color_difference(image->bytes_per_pixel, new_partial_above, back_color, new_above_color);
+    color_difference(bytes_per_pixel, old_partial_above, original_color, old_above_color);
+    color_difference(bytes_per_pixel, new_partial_above, back_color, new_above_color);
     color_d2 d2_above;
     color_delta_difference(new_partial_above, old_partial_above, d2_above);
     uint32_t above_error = color_delta_distance(d2_above);
 
     color_delta old_partial_diag, new_partial_diag;
-    color_difference(image->bytes_per_pixel, old_partial_diag, original_color, old_diag_color);
-    color_difference(image->bytes_per_pixel, new_partial_diag, back_color, new_diag_color);
+    color_difference(bytes_per_pixel, old_partial_diag, original_color, old_diag_color);
+    color_difference(bytes_per_pixel, new_partial_diag, back_color, new_diag_color);
     color_d2 d2_diag;
     color_delta_difference(new_partial_diag, old_partial_diag, d2_diag);
     uint32_t diag_error = color_delta_distance(d2_diag);
 
     color_delta old_partial_left, new_partial_left;
-    color_difference(image->bytes_per_pixel, old_partial_left, original_color, old_left_color);
-    color_difference(image->bytes_per_pixel, new_partial_left, back_color, new_left_color);
+    color_difference(bytes_per_pixel, old_partial_left, original_color, old_left_color);
+    color_difference(bytes_per_pixel, new_partial_left, back_color, new_left_color);
     color_d2 d2_left;
     color_delta_difference(new_partial_left, old_partial_left, d2_left);
     uint32_t left_error = color_delta_distance(d2_left);
@@ -289,26 +684,86 @@ uintmax_t optimize_state_run(
     return total_error;
 }
 
-uintmax_t optimize_state_row(
-    optimize_state *state,
+// Costs the symbols of a finished row against how often they've been used,
+// stopping early once the cost reaches limit. Every use of a symbol in the
+// row costs the same, so the row is costed a symbol at a time from the
+// trial's counts instead of going back over its pixels.
+static uintmax_t optimize_trial_cost(optimize_trial *trial, uintmax_t limit) {
+    optimize_state *state = trial->state;
+    uintmax_t total_cost = 0;
+    for (uint_fast16_t i = 0; i < trial->touched_count && total_cost < limit; i++) {
+        unsigned char symbol = trial->touched_symbols[i];
+        uint32_t count = trial->symbol_frequency[symbol];
+        uintmax_t frequency = (uintmax_t)state->symbol_frequency[symbol] + trial->symbol_frequency[symbol];
+        total_cost += (uintmax_t)count * ulog2(UINTMAX_MAX / frequency);
+    }
+    return total_cost;
+}
+
+static PNGLOSS_ALWAYS_INLINE uintmax_t optimize_trial_row_generic(
+    optimize_trial *trial,
     pngloss_image *image,
     unsigned char *last_row_pixels,
     pngloss_filter filter,
+    uint_fast8_t bytes_per_pixel,
     uint_fast8_t quantization_strength,
     int_fast16_t bleed_divider,
-    bool adaptive
+    bool adaptive,
+    uintmax_t limit
 ) {
+    optimize_state *state = trial->state;
+
+    // A symbol can't be used more than once per channel of the row, so it
+    // costs at least min_symbol_cost once the row is done, and any symbol
+    // at least min_cost. Adding those up for the symbols chosen so far and
+    // the ones still to come gives a cost the trial can't get below, and
+    // once that reaches limit the trial can't win.
+    uint32_t symbols = image->width * bytes_per_pixel;
+    uint_least8_t min_symbol_cost[256];
+    uint_fast8_t min_cost = UINT8_MAX;
+    bool bounded = (limit != UINTMAX_MAX);
+    if (bounded) {
+        for (uint_fast16_t symbol = 0; symbol < 256; symbol++) {
+            uintmax_t frequency = (uintmax_t)state->symbol_frequency[symbol] + symbols;
+            min_symbol_cost[symbol] = ulog2(UINTMAX_MAX / frequency);
+            if (min_cost > min_symbol_cost[symbol]) {
+                min_cost = min_symbol_cost[symbol];
+            }
+        }
+        if ((uintmax_t)symbols * min_cost >= limit) {
+            return UINTMAX_MAX;
+        }
+    }
+    uintmax_t symbol_cost = 0;
+
+    // wide bands are searched in an index of this filter's symbols, which
+    // starts from the committed frequencies and follows this trial's
+    bool indexed = quantization_strength + 1 >= band_index_min_width;
+    if (indexed) {
+        memcpy(trial->band_index, &state->band_indexes[filter], sizeof(band_index));
+    }
+
     uintmax_t total_error = 0;
-    while (state->x < image->width) {
-        uintmax_t error = optimize_state_run(
-            state,
+    while (trial->x < image->width) {
+        uintmax_t error = optimize_trial_pixel(
+            trial,
             image,
             last_row_pixels,
             filter,
+            bytes_per_pixel,
             quantization_strength,
-            bleed_divider
+            bleed_divider,
+            indexed,
+            bounded ? min_symbol_cost : NULL,
+            &symbol_cost
         );
         total_error += error;
+        if (bounded) {
+            uintmax_t remaining = (uintmax_t)(image->width - trial->x) * bytes_per_pixel;
+            if (total_error / 128 + symbol_cost + remaining * min_cost >= limit) {
+                return UINTMAX_MAX;
+            }
+        }
     }
 
     unsigned char *above_row = NULL;
@@ -317,49 +772,118 @@ uintmax_t optimize_state_row(
     }
 
     if (adaptive) {
-        uint_fast8_t adaptive_filter = adaptive_filter_for_rows(image, above_row, state->pixels);
+        uint_fast8_t adaptive_filter = adaptive_filter_for_rows(image, above_row, trial->pixels);
         if (filter != adaptive_filter) {
             return UINTMAX_MAX;
         }
     }
 
-    uint32_t total_cost = 0;
-    for (uint32_t x = 0; x < image->width; x++) {
-        for (uint_fast8_t c = 0; c < image->bytes_per_pixel; c++) {
-            uint32_t offset = x * image->bytes_per_pixel + c;
-            unsigned char left = 0;
-            if (x > 0) {
-                left = state->pixels[offset - image->bytes_per_pixel];
-            }
-            unsigned char predicted = filter_predict(image, x, state->y, filter, c, left);
-            unsigned char symbol = state->pixels[offset] - predicted;
-            uint32_t frequency = state->symbol_frequency[symbol];
-            if (frequency) {
-                uint_fast8_t cost = ulog2(UINTMAX_MAX / frequency);
-                total_cost += cost;
-            }
-        }
+    // the row's cost only grows as symbols are added, so costing stops as
+    // soon as it can't come in under limit
+    uintmax_t error_cost = total_error / 128;
+    if (error_cost >= limit) {
+        return UINTMAX_MAX;
+    }
+    uintmax_t total_cost = optimize_trial_cost(trial, limit - error_cost);
+    if (total_cost >= limit - error_cost) {
+        return UINTMAX_MAX;
     }
 
-    // move color errors up one row
-    uint32_t error_width = image->width + dither_filter_width;
-    memmove(
-        state->color_error,
-        state->color_error + error_width,
-        (dither_row_count - 1) * error_width * sizeof(color_delta)
-    );
-    memset(state->color_error + (dither_row_count - 1) * error_width, 0, error_width * sizeof(color_delta));
-
-    // advance to next row and indicate success and cost to caller
-    state->x = 0;
-    state->y++;
-
+    // indicate success and cost to caller, the winning trial is committed
+    // and advances to the next row
     //fprintf(stderr, "cost %u error %u\n", (unsigned int)total_cost, (unsigned int)total_error);
     //return total_cost;
     //return (total_error + 1) * total_cost;
     return total_error / 128 + total_cost;
 }
 
+// one kernel per filter and pixel size, chosen once per row
+typedef uintmax_t (*optimize_trial_kernel)(
+    optimize_trial *trial,
+    pngloss_image *image,
+    unsigned char *last_row_pixels,
+    uint_fast8_t quantization_strength,
+    int_fast16_t bleed_divider,
+    bool adaptive,
+    uintmax_t limit
+);
+
+#define OPTIMIZE_TRIAL_KERNEL(filter, bytes_per_pixel) \
+    static uintmax_t optimize_trial_kernel_##filter##_##bytes_per_pixel( \
+        optimize_trial *trial, pngloss_image *image, \
+        unsigned char *last_row_pixels, uint_fast8_t quantization_strength, \
+        int_fast16_t bleed_divider, bool adaptive, uintmax_t limit \
+    ) { \
+        return optimize_trial_row_generic( \
+            trial, image, last_row_pixels, filter, bytes_per_pixel, \
+            quantization_strength, bleed_divider, adaptive, limit \
+        ); \
+    }
+
+#define OPTIMIZE_TRIAL_KERNELS(filter) \
+    OPTIMIZE_TRIAL_KERNEL(filter, 1) \
+    OPTIMIZE_TRIAL_KERNEL(filter, 2) \
+    OPTIMIZE_TRIAL_KERNEL(filter, 3) \
+    OPTIMIZE_TRIAL_KERNEL(filter, 4)
+
+OPTIMIZE_TRIAL_KERNELS(pngloss_none)
+OPTIMIZE_TRIAL_KERNELS(pngloss_sub)
+OPTIMIZE_TRIAL_KERNELS(pngloss_up)
+OPTIMIZE_TRIAL_KERNELS(pngloss_average)
+OPTIMIZE_TRIAL_KERNELS(pngloss_paeth)
+
+#define OPTIMIZE_TRIAL_KERNEL_ROW(filter) { \
+    optimize_trial_kernel_##filter##_1, \
+    optimize_trial_kernel_##filter##_2, \
+    optimize_trial_kernel_##filter##_3, \
+    optimize_trial_kernel_##filter##_4, \
+}
+
+static const optimize_trial_kernel optimize_trial_kernels[pngloss_filter_count][4] = {
+    OPTIMIZE_TRIAL_KERNEL_ROW(pngloss_none),
+    OPTIMIZE_TRIAL_KERNEL_ROW(pngloss_sub),
+    OPTIMIZE_TRIAL_KERNEL_ROW(pngloss_up),
+    OPTIMIZE_TRIAL_KERNEL_ROW(pngloss_average),
+    OPTIMIZE_TRIAL_KERNEL_ROW(pngloss_paeth),
+};
+
+uintmax_t optimize_trial_run(
+    optimize_trial *trial,
+    pngloss_image *image,
+    unsigned char *last_row_pixels,
+    pngloss_filter filter,
+    uint_fast8_t quantization_strength,
+    int_fast16_t bleed_divider
+) {
+    assert(trial->state->bands->strength == quantization_strength);
+    return optimize_trial_pixel(
+        trial, image, last_row_pixels, filter, image->bytes_per_pixel,
+        quantization_strength, bleed_divider, false, NULL, NULL
+    );
+}
+
+// Tries the filter on the whole current row and returns its cost, or
+// UINTMAX_MAX if the adaptive filter wouldn't pick it or it can't cost less
+// than limit. A trial given up on partway is left unfinished, which is fine
+// since only the winning trial is committed.
+uintmax_t optimize_trial_row(
+    optimize_trial *trial,
+    pngloss_image *image,
+    unsigned char *last_row_pixels,
+    pngloss_filter filter,
+    uint_fast8_t quantization_strength,
+    int_fast16_t bleed_divider,
+    bool adaptive,
+    uintmax_t limit
+) {
+    assert(image->bytes_per_pixel >= 1 && image->bytes_per_pixel <= 4);
+    assert(trial->state->bands->strength == quantization_strength);
+    return optimize_trial_kernels[filter][image->bytes_per_pixel - 1](
+        trial, image, last_row_pixels, quantization_strength, bleed_divider,
+        adaptive, limit
+    );
+}
+
 unsigned char filter_predict(
     pngloss_image *image, uint32_t x, uint32_t y,
     pngloss_filter filter, uint_fast8_t c, unsigned char left
@@ -373,120 +897,7 @@ unsigned char filter_predict(
         }
     }
 
-    unsigned char (*filter_functions[pngloss_filter_count])(
-        unsigned char, unsigned char, unsigned char
-    ) = {
-        pngloss_filter_none,
-        pngloss_filter_sub,
-        pngloss_filter_up,
-        pngloss_filter_average,
-        pngloss_filter_paeth,
-    };
-
-    unsigned char predicted = filter_functions[filter](above, diag, left);
-    return predicted;
-}
-
-void diffuse_color_error(
-    optimize_state *state, pngloss_image *image,
-    color_delta difference, int_fast16_t bleed_divider
-) {
-    uint32_t error_width = image->width + dither_filter_width;
-
-    // hardcoded 4 instead of bytes_per_pixel because indexing color delta and not pixels
-    for (uint_fast8_t c = 0; c < 4; c++) {
-        int_fast16_t d = difference[c];
-
-        // reduce color bleed
-        d = d / bleed_divider;
-
-        /*
-        // floyd-steinberg dithering
-        int_fast16_t one = d / 16;
-        d -= one;
-        state->color_error[error_width + state->x + 3][c] += one;
-
-        int_fast16_t three = d / 5;
-        d -= three;
-        state->color_error[error_width + state->x + 1][c] += three;
-
-        int_fast16_t five = d * 5/12;
-        d -= five;
-        state->color_error[error_width + state->x + 2][c] += five;
-
-        int_fast16_t seven = d;
-        state->color_error[state->x + 3][c] += seven;
-        */
-
-        /*
-        // two-row sierra dithering
-        int_fast16_t ones = d / 16;
-        d -= ones * 2;
-        state->color_error[error_width + state->x + 0][c] += ones;
-        state->color_error[error_width + state->x + 4][c] += ones;
-
-        //int_fast16_t twos = d / 8;
-        int_fast16_t twos = d / 7;
-        d -= twos * 2;
-        state->color_error[error_width + state->x + 1][c] += twos;
-        state->color_error[error_width + state->x + 3][c] += twos;
-
-        //int_fast16_t threes = d * 3/16;
-        int_fast16_t threes = d * 3/10;
-        d -= threes * 2;
-        state->color_error[error_width + state->x + 2][c] += threes;
-        state->color_error[state->x + 4][c] += threes;
-
-        //int_fast16_t four = d / 4;
-        int_fast16_t four = d;
-        state->color_error[state->x + 3][c] += four;
-        */
-
-        // sierra dithering
-        int_fast16_t twos = d / 16;
-        d -= twos * 4;
-        state->color_error[error_width * 1 + state->x + 0][c] += twos;
-        state->color_error[error_width * 1 + state->x + 4][c] += twos;
-        state->color_error[error_width * 2 + state->x + 1][c] += twos;
-        state->color_error[error_width * 2 + state->x + 3][c] += twos;
-
-        int_fast16_t threes = d / 8;
-        d -= threes * 2;
-        state->color_error[error_width * 0 + state->x + 4][c] += threes;
-        state->color_error[error_width * 2 + state->x + 2][c] += threes;
-
-        int_fast16_t fours = d * 2/9;
-        d -= fours * 2;
-        state->color_error[error_width * 1 + state->x + 1][c] += fours;
-        state->color_error[error_width * 1 + state->x + 3][c] += fours;
-
-        int_fast16_t five = d / 2;
-        d -= five;
-        state->color_error[error_width * 1 + state->x + 2][c] += five;
-
-        state->color_error[error_width * 0 + state->x + 3][c] += d;
-
-        /*
-        // sierra dithering, reduced color bleed
-        int_fast16_t twos = d / 16;
-        state->color_error[error_width * 1 + state->x + 0][c] += twos;
-        state->color_error[error_width * 1 + state->x + 4][c] += twos;
-        state->color_error[error_width * 2 + state->x + 1][c] += twos;
-        state->color_error[error_width * 2 + state->x + 3][c] += twos;
-
-        int_fast16_t threes = d * 3 / 32;
-        state->color_error[error_width * 0 + state->x + 4][c] += threes;
-        state->color_error[error_width * 3 + state->x + 2][c] += threes;
-
-        int_fast16_t fours = d / 8;
-        state->color_error[error_width * 1 + state->x + 1][c] += fours;
-        state->color_error[error_width * 1 + state->x + 3][c] += fours;
-
-        int_fast16_t five = d * 5 / 32;
-        state->color_error[error_width * 0 + state->x + 3][c] += five;
-        state->color_error[error_width * 1 + state->x + 2][c] += five;
-        */
-    }
+    return predict(filter, above, diag, left);
 }
 
 uint_fast8_t adaptive_filter_for_rows(
@@ -561,14 +972,21 @@ uint_fast8_t adaptive_filter_for_rows(
     return pngloss_filter_count;
 }
 
-// calculates floor(log2(x))
+// calculates floor(log2(x)) + 1, or 0 for 0, the number of bits in x
 uint_fast8_t ulog2(uintmax_t x) {
+#if defined(__GNUC__) && UINTMAX_MAX == ULLONG_MAX
+    if (!x) {
+        return 0;
+    }
+    return sizeof(unsigned long long) * CHAR_BIT - __builtin_clzll(x);
+#else
     uint_fast8_t result = 0;
     while (x) {
         x >>= 1;
         result += 1;
     }
     return result;
+#endif
 }
 
 // PNG filters
@@ -1,20 +1,71 @@
 #ifndef OPTIMIZE_STATE_H
 #define OPTIMIZE_STATE_H
 
+#include "band_index.h"
 #include "color_delta.h"
+#include "memory_arena.h"
 #include "pngloss_image.h"
 #include "rwpng.h"
 
+// filtered values further from zero than this always clamp to the nearest
+// color the prediction can reach, whatever the strength
+#define quantization_band_limit 767
+
 // data structures
+
+// The lowest symbol of the band each filtered value is quantized to at one
+// strength, before the band is clamped to colors the prediction can reach.
+// Bands repeat every strength + 1 values, and looking them up keeps the
+// division out of the pixel loop.
 typedef struct {
-    uint32_t x, y;
-    unsigned char *pixels;
+    int_fast16_t strength;
+    int_least16_t min[2 * quantization_band_limit + 1];
+} quantization_bands;
+
+// Everything committed so far: the row being optimized, the color error
+// carried into it and the row below it, and the symbols already chosen.
+// The original image's histograms are only read, so they may be shared;
+// original_frequency_table is set only when the state counted its own.
+// band_indexes has one index per filter of the committed frequencies.
+// States and trials live in a memory_arena and are freed along with it.
+typedef struct {
+    uint32_t y;
     color_delta *color_error;
     uint32_t *symbol_frequency;
     uintmax_t symbol_count;
     uint32_t *original_frequency[5];
+    uint32_t *original_frequency_table;
+    band_index *band_indexes;
+    // rebuilt when the strength changes, see optimize_state_set_strength
+    quantization_bands *bands;
 } optimize_state;
 
+// The band of symbols one channel of a pixel was searched in and the symbol
+// chosen from it. The channel of the next pixel often has the same band.
+typedef struct {
+    int_least16_t predicted, min, max, original_symbol;
+    unsigned char symbol;
+    bool valid;
+} optimize_band_choice;
+
+// One attempt at optimizing the current row with one filter. A trial only
+// reads its optimize_state and records its own changes: the new row, the
+// color error it diffuses into the next three rows, and how often it used
+// each symbol. The winning trial is committed into the state in place.
+typedef struct {
+    optimize_state *state;
+    uint32_t x;
+    unsigned char *pixels;
+    color_delta *color_error;
+    uint32_t *symbol_frequency;
+    unsigned char *touched_symbols;
+    uint_fast16_t touched_count;
+    band_index *band_index;
+    // each channel's band search at the last pixel, and the symbols chosen
+    optimize_band_choice last_choice[4];
+    unsigned char last_symbols[4];
+} optimize_trial;
+
 typedef enum {
     pngloss_none,
     pngloss_sub,
@@ -25,40 +76,57 @@ typedef enum {
 } pngloss_filter;
 
 // function prototypes
+size_t optimize_state_arena_size(uint32_t width, bool own_histograms);
 pngloss_error optimize_state_init(
-    optimize_state *state, pngloss_image *image
+    optimize_state *state, pngloss_image *image,
+    uint32_t *const original_frequency[5], memory_arena *arena
+);
+void optimize_state_set_strength(
+    optimize_state *state, uint_fast8_t quantization_strength
 );
-void optimize_state_destroy(optimize_state *state);
-void optimize_state_copy(
-    optimize_state *to,
-    optimize_state *from,
-    pngloss_image *image
+void original_frequency_count_row(
+    uint32_t *const original_frequency[5], const unsigned char *row,
+    const unsigned char *above_row, uint32_t width, uint_fast8_t bytes_per_pixel
 );
-uintmax_t optimize_state_run(
-    optimize_state *state,
+void original_frequency_count(
+    uint32_t *const original_frequency[5], pngloss_image *image
+);
+size_t optimize_trial_arena_size(uint32_t width, uint_fast8_t bytes_per_pixel);
+pngloss_error optimize_trial_init(
+    optimize_trial *trial, optimize_state *state, pngloss_image *image,
+    memory_arena *arena
+);
+void optimize_trial_begin(optimize_trial *trial, pngloss_image *image);
+void optimize_trial_commit(optimize_trial *trial, pngloss_image *image);
+uintmax_t optimize_trial_run(
+    optimize_trial *trial,
     pngloss_image *image,
     unsigned char *last_row_pixels,
     pngloss_filter filter,
     uint_fast8_t quantization_strength,
     int_fast16_t bleed_divider
 );
-uintmax_t optimize_state_row(
-    optimize_state *state,
+uintmax_t optimize_trial_row(
+    optimize_trial *trial,
     pngloss_image *image,
     unsigned char *last_row_pixels,
     pngloss_filter filter,
     uint_fast8_t quantization_strength,
     int_fast16_t bleed_divider,
-    bool adaptive
+    bool adaptive,
+    uintmax_t limit
 );
 unsigned char filter_predict(
     pngloss_image *image, uint32_t x, uint32_t y,
     pngloss_filter filter, uint_fast8_t c, unsigned char left
 );
 void diffuse_color_error(
-    optimize_state *state, pngloss_image *image,
+    optimize_trial *trial, pngloss_image *image,
     color_delta difference, int_fast16_t bleed_divider
 );
+void optimize_trial_repeat_row(
+    optimize_trial *trial, pngloss_image *image, int_fast16_t bleed_divider
+);
 uint_fast8_t adaptive_filter_for_rows(
     pngloss_image *image, unsigned char *above_row, unsigned char *pixels
 );
@@ -7,7 +7,11 @@
 ** See COPYRIGHT file for license.
 */
 
+// for mmap and posix_madvise
+#define _POSIX_C_SOURCE 200112L
+
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -21,6 +25,14 @@
 #  include <unistd.h>
 #endif
 
+// input files are mapped into memory where the buffer reader can take them
+#if !USE_COCOA && !(defined(_WIN32) || defined(WIN32) || defined(__WIN32__))
+#  define PNGLOSS_MMAP 1
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+
 #include "pngloss_image.h"
 #include "pngloss_opts.h"
 #include "rwpng.h"  /* typedefs, common macros, public prototypes */
@@ -31,14 +43,28 @@ usage:  pngloss [options] -- pngfile [pngfile ...]\n\
 options:\n\
   -s, --strength 19 how much quality to sacrifice, from 0 to 100 (default 19)\n\
   -b, --bleed 2     bleed divider, from 1 (full dithering) to 32767 (none)\n\
+  --threads 1       optimize horizontal strips of the image in parallel\n\
+  --filter-threads 1  try up to 5 row filters in parallel\n\
+  --effort exhaustive  filters tried per row, fast, medium or exhaustive\n\
+  --clean-transparent  make colors of fully transparent pixels compress well\n\
+  -j, --jobs 1      compress this many files in parallel\n\
+  --max-megapixels 64  limit on image pixels decoded at once by all jobs\n\
   -f, --force       overwrite existing output files\n\
   -o, --output file destination file path to use instead of --ext\n\
   -v, --verbose     print status messages\n\
   -q, --quiet       don't print status messages (default, overrides -v)\n\
+  --stats           print where the time went for each file\n\
+  --stats-json      the same, as one JSON object per line\n\
   -V, --version     print version number\n\
   --skip-if-larger  only save converted files if they're smaller than original\n\
   --ext new.png     set custom suffix/extension for output filenames\n\
   --strip           remove optional metadata (default on Mac)\n\
+  --zlib-preset max zlib settings, max (smallest) or latency (fastest)\n\
+  --zlib-level 9    zlib compression level from 0 to 9, overrides preset\n\
+  --zlib-strategy filtered  default, filtered, huffman, rle or fixed\n\
+  --zlib-window-bits 15  zlib window size from 8 to 15 bits\n\
+  --squeeze         write with several zlib settings, keeping the smallest\n\
+  --stream          optimize rows as they're decoded, using little memory\n\
 \n\
 Lossily compresses a PNG by using more compressible colors that are\n\
 close enough to the original color values. The threshold determining\n\
@@ -52,11 +78,33 @@ file exists is to skip the conversion; use --force to overwrite.\n";
 
 char *PNGLOSS_VERSION = "1.0";
 
-static pngloss_error prepare_output_image(png24_image *input_image, rwpng_color_transform tag, png24_image *output_image);
+// Where the time went for one file, for --stats and --stats-json, in wall
+// clock seconds. Phases that didn't run are left at zero.
+typedef struct {
+    double read_seconds;
+    double copy_seconds;
+    double write_seconds;
+    optimize_stats optimize;
+} pngloss_file_stats;
+
+// An input file, either mapped into memory or open for reading.
+typedef struct {
+    FILE *file;
+    const unsigned char *data;
+    size_t size;
+} mapped_input;
+
+static pngloss_error prepare_output_image(png24_image *input_image, bool keep_original, png24_image *output_image);
 static pngloss_error read_image(const char *filename, bool using_stdin, png24_image *input_image_p, bool strip, bool verbose);
 static pngloss_error write_image(png24_image *output_image24, unsigned char *row_filters, const char *outname, struct pngloss_options *options);
 static char *add_filename_extension(const char *filename, const char *newext);
 static bool file_exists(const char *outname);
+static uint64_t image_pixel_count(const char *filename);
+static bool can_stream(const char *filename, const struct pngloss_options *options);
+static pngloss_error pngloss_file_stream(const char *filename, const char *outname, struct pngloss_options *options, memory_arena *arena);
+static void print_stats(const char *filename, const png24_image *input_image, const png24_image *output_image, const pngloss_file_stats *stats, pngloss_error retval, bool json);
+static void print_read_info(const png24_image *input_image);
+static void print_write_info(const png24_image *input_image, const png24_image *output_image, pngloss_error retval);
 
 void pngloss_internal_print_config(FILE *fd) {
     fputs(""
@@ -88,14 +136,22 @@ static void print_usage(FILE *fd)
 }
 
 pngloss_error pngloss_main_internal(struct pngloss_options *options);
-static pngloss_error pngloss_file_internal(const char *filename, const char *outname, struct pngloss_options *options);
+static pngloss_error pngloss_file_internal(const char *filename, const char *outname, struct pngloss_options *options, memory_arena *arena);
 
 #ifndef PNGLOSS_NO_MAIN
 int main(int argc, char *argv[])
 {
     struct pngloss_options options = {
         .strength = 19,
-        .bleed_divider = 2
+        .bleed_divider = 2,
+        .threads = 1,
+        .filter_threads = 1,
+        .effort = optimize_effort_exhaustive,
+        .jobs = 1,
+        .max_megapixels = 64,
+        .zlib_level = -1,
+        .zlib_window_bits = -1,
+        .zlib_strategy = -1
     };
 
     pngloss_error retval = pngloss_parse_options(argc, argv, &options);
@@ -130,6 +186,26 @@ int main(int argc, char *argv[])
         return INVALID_ARGUMENT;
     }
 
+    if (options.threads < 1 || options.threads > 256) {
+        fputs("Must specify a thread count in the range 1-256.\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    if (options.filter_threads < 1 || options.filter_threads > 5) {
+        fputs("Must specify a filter thread count in the range 1-5.\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    if (options.jobs < 1 || options.jobs > 256) {
+        fputs("Must specify a job count in the range 1-256.\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
+    if (options.max_megapixels < 1) {
+        fputs("Must specify at least 1 megapixel for --max-megapixels.\n", stderr);
+        return INVALID_ARGUMENT;
+    }
+
     if (options.extension && options.output_file_path) {
         fputs("--ext and --output options can't be used at the same time\n", stderr);
         return INVALID_ARGUMENT;
@@ -164,34 +240,158 @@ int main(int argc, char *argv[])
 }
 #endif
 
+// The arena belongs to the job compressing the file and is reset once the
+// file is done, so the next file reuses its memory.
+static pngloss_error pngloss_main_file(unsigned int i, struct pngloss_options *options, memory_arena *arena)
+{
+    const char *filename = options->using_stdin ? "stdin" : options->files[i];
+    struct pngloss_options opts = *options;
+    pngloss_error retval = SUCCESS;
+
+    const char *outname = opts.output_file_path;
+    char *outname_free = NULL;
+    if (!opts.using_stdout) {
+        if (!outname) {
+            outname = outname_free = add_filename_extension(filename, opts.extension);
+        }
+        if (!opts.force && file_exists(outname)) {
+            fprintf(stderr, "  error: '%s' exists; not overwriting\n", outname);
+            retval = NOT_OVERWRITING_ERROR;
+        }
+    }
+
+    if (SUCCESS == retval) {
+        retval = pngloss_file_internal(filename, outname, &opts, arena);
+    }
+
+    free(outname_free);
+    memory_arena_reset(arena);
+
+    return retval;
+}
+
+// Files handed out in order to the --jobs threads. Each job reserves its
+// image's pixels before decoding it and waits while the reservations
+// would exceed the budget, unless nothing else is running, so a single
+// image larger than the budget still gets compressed on its own.
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t pixels_released;
+    struct pngloss_options *options;
+    pngloss_error *results;
+    unsigned int next_file;
+    uint64_t pixel_budget;
+    uint64_t pixels_in_use;
+} pngloss_batch;
+
+static void *pngloss_batch_thread(void *context)
+{
+    pngloss_batch *batch = context;
+    memory_arena arena;
+    memory_arena_init(&arena);
+
+    pthread_mutex_lock(&batch->mutex);
+    while (batch->next_file < batch->options->num_files) {
+        unsigned int i = batch->next_file++;
+        pthread_mutex_unlock(&batch->mutex);
+
+        uint64_t pixels = image_pixel_count(batch->options->files[i]);
+        if (pixels > batch->pixel_budget) {
+            pixels = batch->pixel_budget;
+        }
+
+        pthread_mutex_lock(&batch->mutex);
+        while (batch->pixels_in_use && batch->pixels_in_use + pixels > batch->pixel_budget) {
+            pthread_cond_wait(&batch->pixels_released, &batch->mutex);
+        }
+        batch->pixels_in_use += pixels;
+        pthread_mutex_unlock(&batch->mutex);
+
+        batch->results[i] = pngloss_main_file(i, batch->options, &arena);
+
+        pthread_mutex_lock(&batch->mutex);
+        batch->pixels_in_use -= pixels;
+        pthread_cond_broadcast(&batch->pixels_released);
+    }
+    pthread_mutex_unlock(&batch->mutex);
+
+    memory_arena_destroy(&arena);
+    return NULL;
+}
+
+// Compresses every file with options->jobs threads, storing each file's
+// result so they can be summarized in order afterwards.
+static pngloss_error pngloss_main_batch(struct pngloss_options *options, pngloss_error *results)
+{
+    unsigned int thread_count = options->jobs;
+    if (thread_count > options->num_files) {
+        thread_count = options->num_files;
+    }
+
+    pthread_t *threads = calloc(thread_count, sizeof(pthread_t));
+    if (!threads) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    pngloss_batch batch = {
+        .options = options,
+        .results = results,
+        .next_file = 0,
+        .pixel_budget = (uint64_t)options->max_megapixels * 1000000,
+        .pixels_in_use = 0
+    };
+    pthread_mutex_init(&batch.mutex, NULL);
+    pthread_cond_init(&batch.pixels_released, NULL);
+
+    // the calling thread is one of the jobs
+    unsigned int started = 0;
+    while (started + 1 < thread_count) {
+        if (pthread_create(&threads[started], NULL, pngloss_batch_thread, &batch)) {
+            // fewer jobs is slower but still correct
+            break;
+        }
+        started++;
+    }
+    pngloss_batch_thread(&batch);
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&batch.pixels_released);
+    pthread_mutex_destroy(&batch.mutex);
+    free(threads);
+
+    return SUCCESS;
+}
+
 // Don't use this. This is not a public API.
 pngloss_error pngloss_main_internal(struct pngloss_options *options)
 {
     unsigned int error_count = 0, skipped_count = 0, file_count = 0;
     pngloss_error latest_error = SUCCESS;
 
-    for (unsigned int i = 0; i < options->num_files; i++) {
-        const char *filename = options->using_stdin ? "stdin" : options->files[i];
-        struct pngloss_options opts = *options;
-        pngloss_error retval = SUCCESS;
-
-        const char *outname = opts.output_file_path;
-        char *outname_free = NULL;
-        if (!opts.using_stdout) {
-            if (!outname) {
-                outname = outname_free = add_filename_extension(filename, opts.extension);
-            }
-            if (!opts.force && file_exists(outname)) {
-                fprintf(stderr, "  error: '%s' exists; not overwriting\n", outname);
-                retval = NOT_OVERWRITING_ERROR;
-            }
+    pngloss_error *results = NULL;
+    if (options->jobs > 1 && options->num_files > 1 && !options->using_stdin) {
+        results = calloc(options->num_files, sizeof(pngloss_error));
+        if (!results) {
+            return OUT_OF_MEMORY_ERROR;
         }
-
-        if (SUCCESS == retval) {
-            retval = pngloss_file_internal(filename, outname, &opts);
+        pngloss_error retval = pngloss_main_batch(options, results);
+        if (retval) {
+            free(results);
+            return retval;
         }
+    }
 
-        free(outname_free);
+    memory_arena arena;
+    memory_arena_init(&arena);
+    for (unsigned int i = 0; i < options->num_files; i++) {
+        pngloss_error retval;
+        if (results) {
+            retval = results[i];
+        } else {
+            retval = pngloss_main_file(i, options, &arena);
+        }
 
         if (retval) {
             latest_error = retval;
@@ -203,6 +403,8 @@ pngloss_error pngloss_main_internal(struct pngloss_options *options)
         }
         ++file_count;
     }
+    memory_arena_destroy(&arena);
+    free(results);
 
     if (options->verbose) {
         if (error_count) {
@@ -223,86 +425,253 @@ pngloss_error pngloss_main_internal(struct pngloss_options *options)
 }
 
 // I hacked it.
-static pngloss_error pngloss_file_internal(const char *filename, const char *outname, struct pngloss_options *options) {
+static pngloss_error pngloss_file_internal(const char *filename, const char *outname, struct pngloss_options *options, memory_arena *arena) {
     pngloss_error retval = SUCCESS;
 
     if (options->verbose) {
         fprintf(stderr, "%s:\n", filename);
     }
 
+    if (options->stream && can_stream(filename, options)) {
+        return pngloss_file_stream(filename, outname, options, arena);
+    }
+
+    bool want_stats = options->stats || options->stats_json;
+    pngloss_file_stats stats = {.read_seconds=0};
+    double start = optimize_stats_now();
+
     png24_image input_image = {.width=0};
     if (SUCCESS == retval) {
         retval = read_image(filename, options->using_stdin, &input_image, options->strip, options->verbose);
     }
+    stats.read_seconds = optimize_stats_now() - start;
+    bool was_read = (SUCCESS == retval);
 
     if (SUCCESS == retval && options->verbose) {
-        fprintf(stderr, "  read %luKB file\n", (input_image.file_size+500UL)/1000UL);
-
-        if (RWPNG_ICCP == input_image.input_color) {
-            fprintf(stderr, "  used embedded ICC profile to transform image to sRGB colorspace\n");
-        } else if (RWPNG_GAMA_CHRM == input_image.input_color) {
-            fprintf(stderr, "  used gAMA and cHRM chunks to transform image to sRGB colorspace\n");
-        } else if (RWPNG_ICCP_WARN_GRAY == input_image.input_color) {
-            fprintf(stderr, "  warning: ignored ICC profile in GRAY colorspace\n");
-        } else if (RWPNG_COCOA == input_image.input_color) {
-            // No comment
-        } else if (RWPNG_SRGB == input_image.input_color) {
-            fprintf(stderr, "  passing sRGB tag from the input\n");
-        } else if (input_image.gamma != 0.45455) {
-            fprintf(stderr, "  converted image from gamma %2.1f to gamma 2.2\n",
-                           1.0/input_image.gamma);
-        }
+        print_read_info(&input_image);
     }
 
     png24_image output_image = {.width=0};
     if (SUCCESS == retval) {
-        retval = prepare_output_image(&input_image, input_image.output_color, &output_image);
+        start = optimize_stats_now();
+        // only stdin can't be read again if the original has to be written
+        bool keep_original = options->using_stdout && options->skip_if_larger && options->using_stdin;
+        retval = prepare_output_image(&input_image, keep_original, &output_image);
+        stats.copy_seconds = optimize_stats_now() - start;
     }
 
-    // not necessary to check return value because NULL row_filters is valid
-    unsigned char *row_filters = malloc(input_image.height);
-
+    optimize_options optimize = {
+        .quantization_strength = options->strength,
+        .bleed_divider = options->bleed_divider,
+        .strip_threads = options->threads,
+        .filter_threads = options->filter_threads,
+        .effort = options->effort,
+        .clean_transparent = options->clean_transparent,
+        .verbose = options->verbose,
+        .stats = want_stats ? &stats.optimize : NULL,
+        .arena = arena
+    };
+    unsigned char *row_filters = NULL;
+    if (SUCCESS == retval) {
+        // everything the optimizer needs in one block, which after the
+        // first file is usually already there
+        size_t arena_size = optimize_arena_size(output_image.width, output_image.height, output_image.bytes_per_pixel ? output_image.bytes_per_pixel : 4, &optimize);
+        retval = memory_arena_reserve(arena, arena_size + memory_arena_padded(output_image.height));
+    }
     if (SUCCESS == retval) {
-        optimize_with_rows(output_image.row_pointers, output_image.width, output_image.height, row_filters, options->verbose, options->strength, options->bleed_divider);
+        // not necessary to check return value because NULL row_filters is valid
+        row_filters = memory_arena_alloc(arena, output_image.height);
+        retval = optimize_native_rows(output_image.row_pointers, output_image.width, output_image.height, &output_image.bytes_per_pixel, row_filters, &optimize);
+    }
 
+    if (SUCCESS == retval) {
         if (options->skip_if_larger) {
             output_image.maximum_file_size = input_image.file_size - 1;
         }
 
         output_image.chunks = input_image.chunks; input_image.chunks = NULL;
+        start = optimize_stats_now();
         retval = write_image(&output_image, row_filters, outname, options);
+        stats.write_seconds = optimize_stats_now() - start;
 
         if (options->verbose) {
-            if (SUCCESS == retval) {
-                unsigned long kb = ((unsigned long)output_image.file_size + 500UL) / 1000UL;
-                float percent = 100.0f * (float)output_image.file_size / (float)input_image.file_size;
-                fprintf(stderr, "  wrote %luKB file (%.1f%% of original)\n", kb, percent);
-                if (output_image.metadata_size > 0) {
-                    fprintf(stderr, "  copied %dKB of additional PNG metadata\n", (int)(output_image.metadata_size+500)/1000);
-                }
-            } else if (TOO_LARGE_FILE == retval) {
-                unsigned long kb = ((unsigned long)output_image.maximum_file_size + 500UL) / 1000UL;
-                fprintf(stderr, "  file exceeded maximum size of %luKB\n", kb);
-            }
+            print_write_info(&input_image, &output_image, retval);
         }
     }
 
     if (options->using_stdout && (TOO_LARGE_FILE == retval || TOO_LOW_QUALITY == retval)) {
         // when outputting to stdout it'd be nasty to create 0-byte file
         // so if quality is too low, output 24-bit original
-        pngloss_error write_retval = write_image(&input_image, NULL, outname, options);
+        png24_image original_image = {.width=0};
+        png24_image *original = &input_image;
+        pngloss_error write_retval = SUCCESS;
+        if (!input_image.row_pointers) {
+            original = &original_image;
+            write_retval = read_image(filename, false, original, options->strip, false);
+        }
+        if (SUCCESS == write_retval) {
+            write_retval = write_image(original, NULL, outname, options);
+        }
+        rwpng_free_image24(&original_image);
         if (write_retval) {
             retval = write_retval;
         }
     }
 
+    if (want_stats && was_read) {
+        if (options->stats) {
+            print_stats(filename, &input_image, &output_image, &stats, retval, false);
+        }
+        if (options->stats_json) {
+            print_stats(filename, &input_image, &output_image, &stats, retval, true);
+        }
+    }
+
     rwpng_free_image24(&input_image);
     rwpng_free_image24(&output_image);
-    free(row_filters);
 
     return retval;
 }
 
+static void print_read_info(const png24_image *input_image)
+{
+    fprintf(stderr, "  read %luKB file\n", (input_image->file_size+500UL)/1000UL);
+
+    if (RWPNG_ICCP == input_image->input_color) {
+        fprintf(stderr, "  used embedded ICC profile to transform image to sRGB colorspace\n");
+    } else if (RWPNG_GAMA_CHRM == input_image->input_color) {
+        fprintf(stderr, "  used gAMA and cHRM chunks to transform image to sRGB colorspace\n");
+    } else if (RWPNG_ICCP_WARN_GRAY == input_image->input_color) {
+        fprintf(stderr, "  warning: ignored ICC profile in GRAY colorspace\n");
+    } else if (RWPNG_COCOA == input_image->input_color) {
+        // No comment
+    } else if (RWPNG_SRGB == input_image->input_color) {
+        fprintf(stderr, "  passing sRGB tag from the input\n");
+    } else if (input_image->gamma != 0.45455) {
+        fprintf(stderr, "  converted image from gamma %2.1f to gamma 2.2\n",
+                       1.0/input_image->gamma);
+    }
+}
+
+static void print_write_info(const png24_image *input_image, const png24_image *output_image, pngloss_error retval)
+{
+    if (SUCCESS == retval) {
+        unsigned long kb = ((unsigned long)output_image->file_size + 500UL) / 1000UL;
+        float percent = 100.0f * (float)output_image->file_size / (float)input_image->file_size;
+        fprintf(stderr, "  wrote %luKB file (%.1f%% of original)\n", kb, percent);
+        if (output_image->metadata_size > 0) {
+            fprintf(stderr, "  copied %dKB of additional PNG metadata\n", (int)(output_image->metadata_size+500)/1000);
+        }
+    } else if (TOO_LARGE_FILE == retval) {
+        unsigned long kb = ((unsigned long)output_image->maximum_file_size + 500UL) / 1000UL;
+        fprintf(stderr, "  file exceeded maximum size of %luKB\n", kb);
+    }
+}
+
+// Appends to a report being built in memory, which is then printed all at
+// once so that reports from different --jobs don't get interleaved.
+static void stats_append(char *report, size_t size, size_t *length, const char *format, ...)
+{
+    if (*length >= size) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(report + *length, size - *length, format, args);
+    va_end(args);
+    if (written > 0) {
+        *length += (size_t)written;
+    }
+}
+
+static void print_stats(const char *filename, const png24_image *input_image, const png24_image *output_image, const pngloss_file_stats *stats, pngloss_error retval, bool json)
+{
+    static const char *const filter_names[5] = {"none", "sub", "up", "average", "paeth"};
+    const optimize_stats *optimize = &stats->optimize;
+    double total_seconds = stats->read_seconds + stats->copy_seconds +
+        optimize->narrow_seconds + optimize->state_init_seconds +
+        optimize->rows_seconds + stats->write_seconds;
+
+    // escaping can grow each character of the file name to six
+    size_t size = 2048 + 6 * strlen(filename);
+    char *report = malloc(size);
+    if (!report) {
+        return;
+    }
+    size_t length = 0;
+
+    if (json) {
+        stats_append(report, size, &length, "{\"file\": \"");
+        for (const char *c = filename; *c; c++) {
+            unsigned char ch = *c;
+            if (ch == '"' || ch == '\\') {
+                stats_append(report, size, &length, "\\%c", ch);
+            } else if (ch < 0x20) {
+                stats_append(report, size, &length, "\\u%04x", ch);
+            } else {
+                stats_append(report, size, &length, "%c", ch);
+            }
+        }
+        stats_append(report, size, &length,
+            "\", \"status\": %d, \"width\": %u, \"height\": %u,"
+            " \"input_bytes\": %zu, \"output_bytes\": %zu,"
+            " \"read_seconds\": %.6f, \"color_transform_seconds\": %.6f,"
+            " \"copy_seconds\": %.6f, \"narrow_seconds\": %.6f,"
+            " \"state_init_seconds\": %.6f, \"rows_seconds\": %.6f,"
+            " \"write_seconds\": %.6f, \"total_seconds\": %.6f,"
+            " \"strength_fallbacks\": %llu, \"repeated_rows\": %llu,"
+            " \"filter_wins\": {",
+            (int)retval, (unsigned int)input_image->width, (unsigned int)input_image->height,
+            input_image->file_size, output_image->file_size,
+            stats->read_seconds, input_image->color_transform_seconds,
+            stats->copy_seconds, optimize->narrow_seconds,
+            optimize->state_init_seconds, optimize->rows_seconds,
+            stats->write_seconds, total_seconds,
+            (unsigned long long)optimize->strength_fallbacks,
+            (unsigned long long)optimize->repeated_rows
+        );
+        for (unsigned int filter = 0; filter < 5; filter++) {
+            stats_append(report, size, &length, "%s\"%s\": %llu",
+                filter ? ", " : "", filter_names[filter],
+                (unsigned long long)optimize->filter_wins[filter]);
+        }
+        stats_append(report, size, &length, "}}\n");
+    } else {
+        stats_append(report, size, &length,
+            "%s: %ux%u stats\n"
+            "  read            %9.3f ms (color transform %.3f ms)\n"
+            "  copy            %9.3f ms\n"
+            "  narrow format   %9.3f ms\n"
+            "  histogram init  %9.3f ms\n"
+            "  row search      %9.3f ms\n"
+            "  write           %9.3f ms\n"
+            "  total           %9.3f ms\n"
+            "  strength fallbacks %llu\n"
+            "  repeated rows  %llu\n"
+            "  filter wins    ",
+            filename, (unsigned int)input_image->width, (unsigned int)input_image->height,
+            stats->read_seconds * 1000, input_image->color_transform_seconds * 1000,
+            stats->copy_seconds * 1000,
+            optimize->narrow_seconds * 1000,
+            optimize->state_init_seconds * 1000,
+            optimize->rows_seconds * 1000,
+            stats->write_seconds * 1000,
+            total_seconds * 1000,
+            (unsigned long long)optimize->strength_fallbacks,
+            (unsigned long long)optimize->repeated_rows
+        );
+        for (unsigned int filter = 0; filter < 5; filter++) {
+            stats_append(report, size, &length, " %s %llu", filter_names[filter],
+                (unsigned long long)optimize->filter_wins[filter]);
+        }
+        stats_append(report, size, &length, "\n");
+    }
+
+    fputs(report, stderr);
+    fflush(stderr);
+    free(report);
+}
+
 static bool file_exists(const char *outname)
 {
     FILE *outfile = fopen(outname, "rb");
@@ -313,6 +682,53 @@ static bool file_exists(const char *outname)
     return false;
 }
 
+// Reads the IHDR chunk that starts every PNG, without decoding anything.
+static bool read_png_header(const char *filename, unsigned char header[29])
+{
+    FILE *infile = fopen(filename, "rb");
+    if (!infile) {
+        return false;
+    }
+    size_t length = fread(header, 1, 29, infile);
+    fclose(infile);
+    return length == 29 && memcmp(header + 12, "IHDR", 4) == 0;
+}
+
+// Reads the image size from the IHDR chunk, so a job can reserve its
+// pixels before decoding. Returns 0 when the file can't be read, leaving
+// read_image to report the error.
+static uint64_t image_pixel_count(const char *filename)
+{
+    unsigned char header[29];
+    if (!read_png_header(filename, header)) {
+        return 0;
+    }
+
+    uint32_t width = (uint32_t)header[16] << 24 | (uint32_t)header[17] << 16 | (uint32_t)header[18] << 8 | header[19];
+    uint32_t height = (uint32_t)header[20] << 24 | (uint32_t)header[21] << 16 | (uint32_t)header[22] << 8 | header[23];
+    return (uint64_t)width * height;
+}
+
+// --stream reads the file twice, so it needs a file rather than stdin, and
+// decodes a row at a time, which an interlaced image doesn't allow. When
+// writing to stdout it can't take back what it wrote, so it can't write
+// the rows again when they fit a narrower format after optimizing, or fall
+// back to the original when the output is larger. Anything else is left to
+// pngloss_file_stream to report.
+static bool can_stream(const char *filename, const struct pngloss_options *options)
+{
+#if USE_COCOA
+#pragma unused(filename, options)
+    return false;
+#else
+    if (options->using_stdin || options->using_stdout || options->squeeze) {
+        return false;
+    }
+    unsigned char header[29];
+    return !read_png_header(filename, header) || header[28] == 0;
+#endif
+}
+
 /* build the output filename from the input name by inserting "-fs8" or
  * "-or8" before the ".png" extension (or by appending that plus ".png" if
  * there isn't any extension), then make sure it doesn't exist already */
@@ -376,10 +792,11 @@ static bool replace_file(const char *from, const char *to, const bool force) {
     return (0 == rename(from, to));
 }
 
-static pngloss_error write_image(png24_image *output_image24, unsigned char *row_filters, const char *outname, struct pngloss_options *options)
+// Opens stdout, or a temporary file next to outname, for writing.
+static pngloss_error open_output(const char *outname, struct pngloss_options *options, FILE **outfile_p, char **tempname_p)
 {
     FILE *outfile;
-    char *tempname = NULL;
+    *tempname_p = NULL;
 
     if (options->using_stdout) {
         set_binary_mode(stdout);
@@ -389,7 +806,7 @@ static pngloss_error write_image(png24_image *output_image24, unsigned char *row
             fprintf(stderr, "  writing compressed image to stdout\n");
         }
     } else {
-        tempname = temp_filename(outname);
+        char *tempname = temp_filename(outname);
         if (!tempname) return OUT_OF_MEMORY_ERROR;
 
         if ((outfile = fopen(tempname, "wb")) == NULL) {
@@ -397,15 +814,21 @@ static pngloss_error write_image(png24_image *output_image24, unsigned char *row
             free(tempname);
             return CANT_WRITE_ERROR;
         }
+        *tempname_p = tempname;
 
         if (options->verbose) {
             fprintf(stderr, "  writing compressed image as %s\n", filename_part(outname));
         }
     }
 
-    pngloss_error retval;
-    retval = rwpng_write_image24(outfile, output_image24, row_filters);
+    *outfile_p = outfile;
+    return SUCCESS;
+}
 
+// Finishes what open_output started, moving the temporary file over
+// outname when retval is SUCCESS and deleting it otherwise.
+static pngloss_error close_output(FILE *outfile, char *tempname, const char *outname, struct pngloss_options *options, pngloss_error retval)
+{
     if (!options->using_stdout) {
         fclose(outfile);
 
@@ -430,23 +853,91 @@ static pngloss_error write_image(png24_image *output_image24, unsigned char *row
     return retval;
 }
 
-static pngloss_error read_image(const char *filename, bool using_stdin, png24_image *input_image_p, bool strip, bool verbose)
+static pngloss_error write_image(png24_image *output_image24, unsigned char *row_filters, const char *outname, struct pngloss_options *options)
 {
-    FILE *infile;
+    FILE *outfile;
+    char *tempname;
+    pngloss_error retval = open_output(outname, options, &outfile, &tempname);
+    if (retval) {
+        return retval;
+    }
 
-    if (using_stdin) {
-        set_binary_mode(stdin);
-        infile = stdin;
-    } else if ((infile = fopen(filename, "rb")) == NULL) {
+    if (options->squeeze) {
+        retval = rwpng_write_image24_smallest(outfile, output_image24, row_filters, rwpng_deflate_squeeze, rwpng_deflate_squeeze_count);
+    } else {
+        retval = rwpng_write_image24(outfile, output_image24, row_filters, &options->deflate);
+    }
+
+    return close_output(outfile, tempname, outname, options, retval);
+}
+
+// Opens an input file, mapping it into memory when possible so libpng
+// reads it straight from the page cache instead of copying it through
+// read() and stdio's buffer. Falls back to reading the file.
+static pngloss_error open_input(const char *filename, mapped_input *input)
+{
+    input->file = NULL;
+    input->data = NULL;
+    input->size = 0;
+
+#if PNGLOSS_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (0 == fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 && (uintmax_t)st.st_size <= SIZE_MAX) {
+            void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                // libpng reads from start to end
+                posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+                input->data = data;
+                input->size = (size_t)st.st_size;
+            }
+        }
+        close(fd);
+        if (input->data) {
+            return SUCCESS;
+        }
+    }
+#endif
+
+    if ((input->file = fopen(filename, "rb")) == NULL) {
         fprintf(stderr, "  error: cannot open %s for reading\n", filename);
         return READ_ERROR;
     }
+    return SUCCESS;
+}
+
+static void close_input(mapped_input *input)
+{
+#if PNGLOSS_MMAP
+    if (input->data) {
+        munmap((void *)input->data, input->size);
+    }
+#endif
+    if (input->file) {
+        fclose(input->file);
+    }
+}
 
+static pngloss_error read_image(const char *filename, bool using_stdin, png24_image *input_image_p, bool strip, bool verbose)
+{
     pngloss_error retval;
-    retval = rwpng_read_image24(infile, input_image_p, strip, verbose);
 
-    if (!using_stdin) {
-        fclose(infile);
+    if (using_stdin) {
+        set_binary_mode(stdin);
+        retval = rwpng_read_image24(stdin, input_image_p, strip, verbose);
+    } else {
+        mapped_input input;
+        retval = open_input(filename, &input);
+        if (retval) {
+            return retval;
+        }
+        if (input.data) {
+            retval = rwpng_read_image24_buffer(input.data, input.size, input_image_p, strip, verbose);
+        } else {
+            retval = rwpng_read_image24(input.file, input_image_p, strip, verbose);
+        }
+        close_input(&input);
     }
 
     if (retval) {
@@ -457,28 +948,263 @@ static pngloss_error read_image(const char *filename, bool using_stdin, png24_im
     return SUCCESS;
 }
 
-static pngloss_error prepare_output_image(png24_image *input_image, rwpng_color_transform output_color, png24_image *output_image)
+// Hands the decoded pixels to output_image for the optimizer to change in
+// place. input_image keeps a copy of them only when keep_original is set;
+// otherwise the original can be decoded again from the file if it's needed.
+static pngloss_error prepare_output_image(png24_image *input_image, bool keep_original, png24_image *output_image)
 {
     output_image->width = input_image->width;
     output_image->height = input_image->height;
     output_image->gamma = input_image->gamma;
-    output_image->output_color = output_color;
+    output_image->output_color = input_image->output_color;
+    output_image->bytes_per_pixel = input_image->bytes_per_pixel;
+
+    output_image->rgba_data = input_image->rgba_data; input_image->rgba_data = NULL;
+    output_image->row_pointers = input_image->row_pointers; input_image->row_pointers = NULL;
 
-    /*
-    ** Step 3.7 [GRR]: allocate memory for the entire indexed image
-    */
+    if (!keep_original) {
+        return SUCCESS;
+    }
 
-    output_image->rgba_data = malloc((size_t)output_image->height * (size_t)output_image->width * 4);
-    output_image->row_pointers = malloc((size_t)output_image->height * sizeof(output_image->row_pointers[0]));
+    size_t rowbytes = (size_t)input_image->width * input_image->bytes_per_pixel;
+    input_image->rgba_data = malloc((size_t)input_image->height * rowbytes);
+    input_image->row_pointers = malloc((size_t)input_image->height * sizeof(input_image->row_pointers[0]));
 
-    if (!output_image->rgba_data || !output_image->row_pointers) {
+    if (!input_image->rgba_data || !input_image->row_pointers) {
         return OUT_OF_MEMORY_ERROR;
     }
 
-    for(size_t row = 0; row < output_image->height; row++) {
-        output_image->row_pointers[row] = output_image->rgba_data + row * output_image->width * 4;
-        memcpy(output_image->row_pointers[row], input_image->row_pointers[row], output_image->width * 4);
+    for(size_t row = 0; row < input_image->height; row++) {
+        input_image->row_pointers[row] = input_image->rgba_data + row * rowbytes;
+        memcpy(input_image->row_pointers[row], output_image->row_pointers[row], rowbytes);
     }
 
     return SUCCESS;
 }
+
+static pngloss_error open_row_reader(mapped_input *input, png24_image *header, bool strip, bool verbose, rwpng_row_reader **reader_p)
+{
+    if (input->data) {
+        return rwpng_row_reader_open_buffer(input->data, input->size, header, strip, verbose, reader_p);
+    }
+    return rwpng_row_reader_open(input->file, header, strip, verbose, reader_p);
+}
+
+// A second pass of pngloss_file_stream: decodes the rows of input again,
+// optimizes them and writes them to outfile with output_bytes per pixel.
+// Sets *optimized_bytes to the narrowest format the optimized rows fit.
+static pngloss_error stream_optimized_rows(
+    mapped_input *input, png24_image *input_image, png24_image *output_image,
+    FILE *outfile, uint_fast8_t bytes_per_pixel, uint_fast8_t output_bytes,
+    uint32_t *original_frequency[5], struct pngloss_options *options,
+    const optimize_options *optimize, pngloss_file_stats *stats,
+    uint_fast8_t *optimized_bytes
+) {
+    double start = optimize_stats_now();
+    png24_image second_image = {.width=0};
+    rwpng_row_reader *reader = NULL;
+    pngloss_error retval;
+    if (input->file && fseek(input->file, 0, SEEK_SET)) {
+        retval = READ_ERROR;
+    } else {
+        retval = open_row_reader(input, &second_image, true, false, &reader);
+    }
+    stats->read_seconds += optimize_stats_now() - start;
+
+    rwpng_row_writer *writer = NULL;
+    if (SUCCESS == retval) {
+        start = optimize_stats_now();
+        retval = rwpng_row_writer_open(outfile, output_image, output_bytes, &options->deflate, &writer);
+        stats->write_seconds += optimize_stats_now() - start;
+    }
+
+    uint32_t width = output_image->width;
+    optimize_stream *stream = NULL;
+    unsigned char *rgba = malloc((size_t)width * 4);
+    unsigned char *row = malloc((size_t)width * bytes_per_pixel);
+    if (SUCCESS == retval) {
+        retval = optimize_stream_create(&stream, width, output_image->height, bytes_per_pixel, output_bytes, original_frequency, optimize);
+        if (SUCCESS == retval && (!rgba || !row)) {
+            retval = OUT_OF_MEMORY_ERROR;
+        }
+    }
+    for (uint32_t y = 0; SUCCESS == retval && y < output_image->height; y++) {
+        start = optimize_stats_now();
+        retval = rwpng_row_reader_next(reader, rgba);
+        double decoded = optimize_stats_now();
+        stats->read_seconds += decoded - start;
+        if (retval) {
+            break;
+        }
+
+        narrow_row(rgba, row, width, bytes_per_pixel);
+        double narrowed = optimize_stats_now();
+        stats->optimize.narrow_seconds += narrowed - decoded;
+
+        unsigned char *optimized;
+        unsigned char filter = optimize_stream_row(stream, row, &optimized);
+
+        start = optimize_stats_now();
+        retval = rwpng_row_writer_write(writer, optimized, filter);
+        stats->write_seconds += optimize_stats_now() - start;
+    }
+    if (SUCCESS == retval) {
+        *optimized_bytes = optimize_stream_finish(stream);
+    }
+
+    optimize_stream_destroy(stream);
+    pngloss_error close_retval = rwpng_row_reader_close(reader);
+    if (SUCCESS == retval) {
+        retval = close_retval;
+    }
+    input_image->color_transform_seconds += second_image.color_transform_seconds;
+    start = optimize_stats_now();
+    close_retval = rwpng_row_writer_close(writer);
+    stats->write_seconds += optimize_stats_now() - start;
+    if (SUCCESS == retval) {
+        retval = close_retval;
+    }
+
+    rwpng_free_image24(&second_image);
+    free(rgba);
+    free(row);
+    return retval;
+}
+
+// Compresses a file for --stream without holding its pixels in memory.
+// The optimizer needs histograms of the whole image before it starts, so
+// the file is decoded twice: the first pass picks the pixel format and
+// counts the histograms, and the second optimizes each row as it's decoded
+// and writes it straight out. If the optimized rows turn out to fit a
+// narrower format, a third pass writes them again in it. Only a few rows,
+// and a pointer per row, are kept at a time.
+static pngloss_error pngloss_file_stream(const char *filename, const char *outname, struct pngloss_options *options, memory_arena *arena)
+{
+    bool want_stats = options->stats || options->stats_json;
+    pngloss_file_stats stats = {.read_seconds=0};
+    double start = optimize_stats_now();
+
+    mapped_input input;
+    pngloss_error retval = open_input(filename, &input);
+    if (retval) {
+        return retval;
+    }
+
+    png24_image input_image = {.width=0};
+    rwpng_row_reader *reader = NULL;
+    optimize_scan *scan = NULL;
+    unsigned char *rgba = NULL;
+    retval = open_row_reader(&input, &input_image, options->strip, options->verbose, &reader);
+    if (SUCCESS == retval) {
+        rgba = malloc((size_t)input_image.width * 4);
+        retval = optimize_scan_create(&scan, input_image.width);
+        if (SUCCESS == retval && !rgba) {
+            retval = OUT_OF_MEMORY_ERROR;
+        }
+    }
+    for (uint32_t y = 0; SUCCESS == retval && y < input_image.height; y++) {
+        retval = rwpng_row_reader_next(reader, rgba);
+        if (SUCCESS == retval) {
+            optimize_scan_row(scan, rgba);
+        }
+    }
+    pngloss_error close_retval = rwpng_row_reader_close(reader);
+    reader = NULL;
+    if (SUCCESS == retval) {
+        retval = close_retval;
+    }
+    stats.read_seconds = optimize_stats_now() - start;
+    bool was_read = (SUCCESS == retval);
+
+    if (retval) {
+        fprintf(stderr, "  error: cannot decode image %s\n", filename_part(filename));
+    } else if (options->verbose) {
+        print_read_info(&input_image);
+    }
+
+    png24_image output_image = {.width=0};
+    uint32_t *original_frequency[5];
+    uint_fast8_t bytes_per_pixel = 0;
+    if (SUCCESS == retval) {
+        bytes_per_pixel = optimize_scan_finish(scan, original_frequency);
+
+        output_image.width = input_image.width;
+        output_image.height = input_image.height;
+        output_image.gamma = input_image.gamma;
+        output_image.output_color = input_image.output_color;
+        output_image.chunks = input_image.chunks; input_image.chunks = NULL;
+        if (options->skip_if_larger) {
+            output_image.maximum_file_size = input_image.file_size - 1;
+        }
+    }
+
+    // the second pass decodes the same rows again, without the chunks
+    FILE *outfile = NULL;
+    char *tempname = NULL;
+    bool output_open = false;
+    if (SUCCESS == retval) {
+        retval = open_output(outname, options, &outfile, &tempname);
+        output_open = (SUCCESS == retval);
+    }
+    if (SUCCESS == retval) {
+        optimize_options optimize = {
+            .quantization_strength = options->strength,
+            .bleed_divider = options->bleed_divider,
+            .strip_threads = 1,
+            .filter_threads = options->filter_threads,
+            .effort = options->effort,
+            .clean_transparent = options->clean_transparent,
+            .verbose = options->verbose,
+            .stats = want_stats ? &stats.optimize : NULL,
+            .arena = arena
+        };
+        uint_fast8_t optimized_bytes = bytes_per_pixel;
+        retval = stream_optimized_rows(&input, &input_image, &output_image, outfile, bytes_per_pixel, bytes_per_pixel, original_frequency, options, &optimize, &stats, &optimized_bytes);
+
+        // Optimizing can make nearly gray colors gray and nearly opaque
+        // alpha opaque, as the whole-image path finds after optimizing.
+        // The rows are gone by then, so they're optimized again, which
+        // gives the same rows, and written over in the narrower format.
+        if ((SUCCESS == retval || TOO_LARGE_FILE == retval) && optimized_bytes != bytes_per_pixel) {
+            if (options->verbose) {
+                fprintf(stderr, "  optimized rows fit %d bytes per pixel, writing them again\n", (int)optimized_bytes);
+            }
+            memory_arena_reset(arena);
+            outfile = freopen(tempname, "wb", outfile);
+            if (!outfile) {
+                fprintf(stderr, "  error: cannot open '%s' for writing\n", tempname);
+                unlink(tempname);
+                free(tempname);
+                output_open = false;
+                retval = CANT_WRITE_ERROR;
+            } else {
+                retval = stream_optimized_rows(&input, &input_image, &output_image, outfile, bytes_per_pixel, optimized_bytes, original_frequency, options, &optimize, &stats, &optimized_bytes);
+            }
+        }
+    }
+
+    if (output_open) {
+        retval = close_output(outfile, tempname, outname, options, retval);
+    }
+    close_input(&input);
+
+    if (was_read && options->verbose) {
+        print_write_info(&input_image, &output_image, retval);
+    }
+
+    if (want_stats && was_read) {
+        if (options->stats) {
+            print_stats(filename, &input_image, &output_image, &stats, retval, false);
+        }
+        if (options->stats_json) {
+            print_stats(filename, &input_image, &output_image, &stats, retval, true);
+        }
+    }
+
+    optimize_scan_destroy(scan);
+    rwpng_free_image24(&input_image);
+    rwpng_free_image24(&output_image);
+    free(rgba);
+
+    return retval;
+}
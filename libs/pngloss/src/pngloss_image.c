@@ -16,6 +16,7 @@
 */
 
 #include <png.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -25,6 +26,27 @@
 #include "optimize_state.h"
 #include "pngloss_image.h"
 #include "rwpng.h"
+#include "trial_pool.h"
+
+// wall clock seconds from an arbitrary start, for optimize_stats
+double optimize_stats_now(void) {
+    struct timeval tp;
+    if (gettimeofday(&tp, NULL)) {
+        return 0;
+    }
+    return (double)tp.tv_sec + (double)tp.tv_usec / 1e6;
+}
+
+void optimize_stats_add(optimize_stats *total, const optimize_stats *stats) {
+    total->narrow_seconds += stats->narrow_seconds;
+    total->state_init_seconds += stats->state_init_seconds;
+    total->rows_seconds += stats->rows_seconds;
+    total->strength_fallbacks += stats->strength_fallbacks;
+    total->repeated_rows += stats->repeated_rows;
+    for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+        total->filter_wins[filter] += stats->filter_wins[filter];
+    }
+}
 
 void optimizeForAverageFilter(
     unsigned char pixels[], int width, int height, int quantization_strength
@@ -41,59 +63,164 @@ void optimize_with_stride(
     unsigned char *pixels, uint32_t width, uint32_t height, uint32_t stride,
     bool verbose, uint_fast8_t quantization_strength, int_fast16_t bleed_divider
 ) {
+    optimize_options options = {
+        .quantization_strength = quantization_strength,
+        .bleed_divider = bleed_divider,
+        .strip_threads = 1,
+        .filter_threads = 1,
+        .effort = optimize_effort_exhaustive,
+        .verbose = verbose
+    };
     unsigned char **rows = malloc((size_t)height * sizeof(unsigned char *));
     for (uint32_t i = 0; i < height; i++) {
         rows[i] = pixels + i*stride;
     }
-    optimize_with_rows(rows, width, height, NULL, verbose, quantization_strength, bleed_divider);
+    optimize_with_rows(rows, width, height, NULL, &options);
     free(rows);
 }
 
-pngloss_error optimize_with_rows(
+// Converts a row of RGBA pixels to gray, gray and alpha, or RGB by the
+// number of bytes per pixel. Gray is taken from the green channel.
+void narrow_row(
+    const unsigned char *rgba, unsigned char *row, uint32_t width,
+    uint_fast8_t bytes_per_pixel
+) {
+    for (uint32_t x = 0; x < width; x++) {
+        const unsigned char *original = rgba + (size_t)x*4;
+        unsigned char *pixel = row + (size_t)x*bytes_per_pixel;
+        if (1 == bytes_per_pixel) {
+            pixel[0] = original[1];
+        } else if (2 == bytes_per_pixel) {
+            pixel[0] = original[1];
+            pixel[1] = original[3];
+        } else {
+            memcpy(pixel, original, bytes_per_pixel);
+        }
+    }
+}
+
+// The bytes per pixel of gray, gray and alpha, RGB or RGBA.
+static uint_fast8_t format_bytes_per_pixel(bool grayscale, bool opaque) {
+    if (grayscale) {
+        return opaque ? 1 : 2;
+    }
+    return opaque ? 3 : 4;
+}
+
+// Finds the smallest of gray, gray and alpha, RGB and RGBA that holds rows
+// of the given bytes per pixel without losing anything.
+static uint_fast8_t narrowest_format(
     unsigned char **rows, uint32_t width, uint32_t height,
-    unsigned char *row_filters, bool verbose,
-    uint_fast8_t quantization_strength, int_fast16_t bleed_divider
+    uint_fast8_t bytes_per_pixel
 ) {
-    pngloss_error retval = SUCCESS;
-    pngloss_image original_image = {
-        .rows = rows,
-        .width = width,
-        .height = height,
-        .bytes_per_pixel = 4
-    };
+    bool has_color = (bytes_per_pixel >= 3);
+    bool has_alpha = (bytes_per_pixel % 2 == 0);
     bool grayscale = true;
-    bool strip_alpha = true;
+    bool opaque = true;
 
-    for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t y = 0; y < height && ((has_color && grayscale) || (has_alpha && opaque)); y++) {
         for (uint32_t x = 0; x < width; x++) {
-            unsigned char *pixel = rows[y] + x*4;
-            if (pixel[0] != pixel[1] || pixel[1] != pixel[2]) {
+            unsigned char *pixel = rows[y] + (size_t)x*bytes_per_pixel;
+            if (has_color && (pixel[0] != pixel[1] || pixel[1] != pixel[2])) {
                 grayscale = false;
             }
-            if (pixel[3] < 255) {
-                strip_alpha = false;
+            if (has_alpha && pixel[bytes_per_pixel - 1] < 255) {
+                opaque = false;
             }
         }
-        if (!grayscale && !strip_alpha) {
-            break;
+    }
+
+    if (has_color && !grayscale) {
+        return (has_alpha && !opaque) ? 4 : 3;
+    }
+    return (has_alpha && !opaque) ? 2 : 1;
+}
+
+// Converts rows to a narrower format that holds them, see
+// narrowest_format, in place. Gray is taken from the green channel.
+static void narrow_rows_in_place(
+    unsigned char **rows, uint32_t width, uint32_t height,
+    uint_fast8_t from_bytes, uint_fast8_t to_bytes
+) {
+    uint_fast8_t gray = (from_bytes >= 3) ? 1 : 0;
+    uint_fast8_t alpha = from_bytes - 1;
+
+    for (uint32_t y = 0; y < height; y++) {
+        unsigned char *row = rows[y];
+        // every pixel moves down or stays, so going forward reads each one
+        // before anything overwrites it
+        for (uint32_t x = 0; x < width; x++) {
+            const unsigned char *original = row + (size_t)x*from_bytes;
+            unsigned char *pixel = row + (size_t)x*to_bytes;
+            unsigned char r = original[0], g = original[gray], b = original[2 * gray];
+            unsigned char a = original[alpha];
+            if (1 == to_bytes) {
+                pixel[0] = g;
+            } else if (2 == to_bytes) {
+                pixel[0] = g;
+                pixel[1] = a;
+            } else {
+                pixel[0] = r;
+                pixel[1] = g;
+                pixel[2] = b;
+            }
         }
     }
+}
+
+// Points the options at a private arena for one call when the caller
+// didn't give one. private_arena_end frees it.
+static const optimize_options *private_arena_begin(
+    const optimize_options *options, optimize_options *private_options,
+    memory_arena *private_arena
+) {
+    if (options->arena) {
+        return options;
+    }
+    memory_arena_init(private_arena);
+    *private_options = *options;
+    private_options->arena = private_arena;
+    return private_options;
+}
+
+static void private_arena_end(
+    const optimize_options *options, memory_arena *private_arena
+) {
+    if (options->arena == private_arena) {
+        memory_arena_destroy(private_arena);
+    }
+}
+
+pngloss_error optimize_with_rows(
+    unsigned char **rows, uint32_t width, uint32_t height,
+    unsigned char *row_filters, const optimize_options *options
+) {
+    optimize_options private_options;
+    memory_arena private_arena;
+    options = private_arena_begin(options, &private_options, &private_arena);
+
+    pngloss_error retval = SUCCESS;
+    pngloss_image original_image = {
+        .rows = rows,
+        .width = width,
+        .height = height,
+        .bytes_per_pixel = 4
+    };
+    optimize_stats *stats = options->stats;
+    double start = stats ? optimize_stats_now() : 0;
+
+    uint_fast8_t bytes_per_pixel = narrowest_format(rows, width, height, 4);
+    bool grayscale = (bytes_per_pixel <= 2);
+    bool strip_alpha = (bytes_per_pixel % 2 == 1);
     if (grayscale || strip_alpha) {
         pngloss_image image = {
             .width = width,
-            .height = height
+            .height = height,
+            .bytes_per_pixel = bytes_per_pixel
         };
 
-        if (grayscale && strip_alpha) {
-            image.bytes_per_pixel = 1;
-        } else if (grayscale) {
-            image.bytes_per_pixel = 2;
-        } else {
-            image.bytes_per_pixel = 3;
-        }
-
-        image.rows = malloc((size_t)height * sizeof(unsigned char **));
-        unsigned char *pixels = malloc((size_t)height * width * image.bytes_per_pixel);
+        image.rows = memory_arena_alloc(options->arena, (size_t)height * sizeof(unsigned char **));
+        unsigned char *pixels = memory_arena_alloc(options->arena, (size_t)height * width * image.bytes_per_pixel);
 
         if (!image.rows || !pixels) {
             retval = OUT_OF_MEMORY_ERROR;
@@ -105,24 +232,15 @@ pngloss_error optimize_with_rows(
         if (SUCCESS == retval) {
             for (uint32_t y = 0; y < height; y++) {
                 image.rows[y] = pixels + (size_t)y * width * image.bytes_per_pixel;
-                for (uint32_t x = 0; x < width; x++) {
-                    unsigned char *original = rows[y] + (size_t)x*4;
-                    unsigned char *pixel = image.rows[y] + (size_t)x*image.bytes_per_pixel;
-                    if (grayscale && strip_alpha) {
-                        pixel[0] = original[1];
-                    } else if (grayscale) {
-                        pixel[0] = original[1];
-                        pixel[1] = original[3];
-                    } else {
-                        pixel[0] = original[0];
-                        pixel[1] = original[1];
-                        pixel[2] = original[2];
-                    }
-                }
+                narrow_row(rows[y], image.rows[y], width, image.bytes_per_pixel);
+            }
+            if (stats) {
+                stats->narrow_seconds += optimize_stats_now() - start;
             }
-            retval = optimize_image(&image, row_filters, verbose, quantization_strength, bleed_divider);
+            retval = optimize_image_strips(&image, row_filters, options);
         }
         if (SUCCESS == retval) {
+            start = stats ? optimize_stats_now() : 0;
             for (uint32_t y = 0; y < height; y++) {
                 for (uint32_t x = 0; x < width; x++) {
                     unsigned char *original = rows[y] + (size_t)x*4;
@@ -145,177 +263,409 @@ pngloss_error optimize_with_rows(
                     }
                 }
             }
+            if (stats) {
+                stats->narrow_seconds += optimize_stats_now() - start;
+            }
         }
-        free(pixels);
-        free(image.rows);
     } else {
-        retval = optimize_image(&original_image, row_filters, verbose, quantization_strength, bleed_divider);
+        if (stats) {
+            stats->narrow_seconds += optimize_stats_now() - start;
+        }
+        retval = optimize_image_strips(&original_image, row_filters, options);
     }
 
+    private_arena_end(options, &private_arena);
     return retval;
 }
 
-#define spin_count 4
-pngloss_error optimize_image(
-    pngloss_image *image, unsigned char *row_filters, bool verbose,
-    uint_fast8_t quantization_strength, int_fast16_t bleed_divider
+pngloss_error optimize_native_rows(
+    unsigned char **rows, uint32_t width, uint32_t height,
+    uint_fast8_t *bytes_per_pixel, unsigned char *row_filters,
+    const optimize_options *options
 ) {
-    pngloss_error retval;
-    int spinner[spin_count] = {'-', '/', '|', '\\'};
-    uint_fast8_t spin_index = 0;
+    optimize_stats *stats = options->stats;
+    double start = stats ? optimize_stats_now() : 0;
 
-    optimize_state state = {
-        .pixels = NULL,
-        .color_error = NULL,
-        .symbol_frequency = NULL
+    uint_fast8_t from_bytes = *bytes_per_pixel ? *bytes_per_pixel : 4;
+    pngloss_image image = {
+        .rows = rows,
+        .width = width,
+        .height = height,
+        .bytes_per_pixel = narrowest_format(rows, width, height, from_bytes)
     };
-    retval = optimize_state_init(&state, image);
+    if (image.bytes_per_pixel != from_bytes) {
+        narrow_rows_in_place(rows, width, height, from_bytes, image.bytes_per_pixel);
+    }
+    *bytes_per_pixel = image.bytes_per_pixel;
+    if (stats) {
+        stats->narrow_seconds += optimize_stats_now() - start;
+    }
 
-    optimize_state best = {
-        .pixels = NULL,
-        .color_error = NULL,
-        .symbol_frequency = NULL
-    };
-    if (SUCCESS == retval) {
-        retval = optimize_state_init(&best, image);
+    pngloss_error retval = optimize_image_strips(&image, row_filters, options);
+    if (SUCCESS != retval) {
+        return retval;
     }
 
-    optimize_state filter_state = {
-        .pixels = NULL,
-        .color_error = NULL,
-        .symbol_frequency = NULL
-    };
-    if (SUCCESS == retval) {
-        retval = optimize_state_init(&filter_state, image);
+    // Optimizing can make nearly gray colors gray and nearly opaque alpha
+    // opaque, so look again for channels the writer can drop. The filters
+    // chosen still apply to the narrower rows.
+    start = stats ? optimize_stats_now() : 0;
+    uint_fast8_t optimized_bytes = narrowest_format(rows, width, height, image.bytes_per_pixel);
+    if (optimized_bytes != image.bytes_per_pixel) {
+        narrow_rows_in_place(rows, width, height, image.bytes_per_pixel, optimized_bytes);
+    }
+    *bytes_per_pixel = optimized_bytes;
+    if (stats) {
+        stats->narrow_seconds += optimize_stats_now() - start;
     }
 
-    unsigned char *last_row_pixels = NULL;
-    if (SUCCESS == retval) {
-        last_row_pixels = calloc((size_t)image->width, image->bytes_per_pixel);
+    return SUCCESS;
+}
+
+// Strips shorter than this aren't worth a thread, since every strip below
+// the first also optimizes up to strip_warmup_rows rows above it.
+static const uint32_t strip_min_rows = 128;
+
+// How many strips optimize_image_strips cuts an image this tall into.
+static uint32_t strip_count_for(uint32_t height, const optimize_options *options) {
+    uint32_t strip_count = options->strip_threads;
+    if (strip_count > height / strip_min_rows) {
+        strip_count = height / strip_min_rows;
     }
+    return strip_count ? strip_count : 1;
+}
+
+// Rows above a strip it optimizes first, on copies of their original
+// pixels, and then throws away. They leave the strip's first row with
+// color error and symbol statistics much like the ones the strip above
+// ends with, for at most half again the strip's own work.
+static const uint32_t strip_warmup_rows = 64;
+
+// Where a strip's image sits in the whole image: its first warmup_rows
+// rows are private warm-up rows, whose filters and statistics aren't
+// kept, and its row 0 is row first_y of the whole image.
+typedef struct {
+    uint32_t first_y;
+    uint32_t warmup_rows;
+} optimize_strip_place;
+
+typedef struct {
+    pngloss_image image;
+    unsigned char *row_filters;
+    uint32_t **original_frequency;
+    optimize_strip_place place;
+    optimize_options options;
+    optimize_stats stats;
+    pngloss_error retval;
+} optimize_strip;
+
+static pngloss_error optimize_image_internal(
+    pngloss_image *image, unsigned char *row_filters,
+    const optimize_options *options, uint32_t *const original_frequency[5],
+    const optimize_strip_place *place
+);
+
+static void *optimize_strip_thread(void *context) {
+    optimize_strip *strip = context;
+    strip->retval = optimize_image_internal(
+        &strip->image,
+        strip->row_filters,
+        &strip->options,
+        strip->original_frequency,
+        &strip->place
+    );
+    return NULL;
+}
+
+pngloss_error optimize_image_strips(
+    pngloss_image *image, unsigned char *row_filters,
+    const optimize_options *options
+) {
+    uint32_t strip_count = strip_count_for(image->height, options);
+    if (strip_count <= 1) {
+        return optimize_image(image, row_filters, options);
+    }
+
+    optimize_options private_options;
+    memory_arena private_arena;
+    options = private_arena_begin(options, &private_options, &private_arena);
+
+    pngloss_error retval = SUCCESS;
+    memory_arena *arena = options->arena;
+    optimize_strip *strips = memory_arena_calloc(arena, strip_count, sizeof(optimize_strip));
+    pthread_t *threads = memory_arena_calloc(arena, strip_count, sizeof(pthread_t));
+    bool *started = memory_arena_calloc(arena, strip_count, sizeof(bool));
+    uint32_t *frequency_table = memory_arena_calloc(arena, 5 * 256, sizeof(uint32_t));
+    if (!strips || !threads || !started || !frequency_table) {
+        retval = OUT_OF_MEMORY_ERROR;
+    }
+    uint32_t *original_frequency[5];
 
     if (SUCCESS == retval) {
-        struct timeval tp;
-        time_t old_sec = 0;
-        suseconds_t old_dsec = 0;
-        while (state.y < image->height) {
-            uint32_t current_y = state.y;
-            uintmax_t best_cost = UINTMAX_MAX;
-            uint_fast8_t best_strength = 0;
-            uint_fast8_t best_filter = 0;
-            bool found_best = false;
-            uint_fast8_t strength = quantization_strength;
-            // PNG spec section 5.9 says,
-            // "the first row must always be adaptively filtered"
-            bool adaptive = (!row_filters || !current_y);
-            while (!found_best) {
-            //for (uint_fast8_t strength = 0; strength <= quantization_strength; strength++)
-                for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
-                    if (verbose) {
-                        // print progress display
-                        int err;
-                        err = gettimeofday(&tp, NULL);
-                        if (err) {
-                            spin_index = (spin_index + 1) % spin_count;
-                        } else {
-                            suseconds_t dsec = tp.tv_usec / 100000;
-                            if (old_sec != tp.tv_sec || old_dsec != dsec) {
-                                old_sec = tp.tv_sec;
-                                old_dsec = dsec;
-                                spin_index = (spin_index + 1) % spin_count;
-                            }
-                        }
-
-                        uint_fast8_t progress = filter;
-                        if (strength != quantization_strength) {
-                            progress = pngloss_filter_count;
-                        }
-                        float percent = 100.0f * (float)(current_y * (pngloss_filter_count + 1) + progress) / (float)(image->height * (pngloss_filter_count + 1));
-
-                        fprintf(stderr, "\x1B[\x01G%c %.1f%% complete", spinner[spin_index], percent);
-                        fflush(stderr);
-                    }
+        double start = options->stats ? optimize_stats_now() : 0;
 
-                    // get to work
-                    optimize_state_copy(&filter_state, &state, image);
-                    uintmax_t cost = optimize_state_row(
-                        &filter_state,
-                        image,
-                        last_row_pixels,
-                        filter,
-                        strength,
-                        bleed_divider,
-                        adaptive
-                    );
-                    /*
-                    fprintf(stderr, "filter %u costs %lu\n", (unsigned int)filter, (unsigned long)cost);
-                    if (cost < (uint32_t)-1) {
-                        fprintf(stderr, "filter %u costs %u\n", (unsigned int)filter, (unsigned int)cost);
-                    }
-                    */
-
-                    if (best_cost > cost) {
-                        best_cost = cost;
-                        best_filter = filter;
-                        best_strength = strength;
-                        found_best = true;
-                        optimize_state_copy(&best, &filter_state, image);
-                    }
-                }
+        // Every strip breaks ties between symbols using the histograms of
+        // the whole original image, just like a single-threaded run would.
+        // They must be counted before any thread starts modifying rows.
+        for (uint_fast8_t filter = 0; filter < 5; filter++) {
+            original_frequency[filter] = frequency_table + filter * 256;
+        }
+        original_frequency_count(original_frequency, image);
 
-                // If already at zero strength, can't try again, so fail.
-                // This should be impossible but check anyway.
-                if (!found_best && !strength) {
-                    fprintf(stderr, "\naborting because no good row at y == %d\n", (int)current_y);
-                    abort();
-                }
+        // Each strip first optimizes copies of the original rows above it,
+        // so it starts out close to where the strip above leaves off, and
+        // no thread ever reads a row that another thread is writing.
+        // Boundaries depend only on the image height and thread count,
+        // which makes the output deterministic for a given thread count.
+        size_t row_size = (size_t)image->width * image->bytes_per_pixel;
+        for (uint32_t i = 0; i < strip_count && SUCCESS == retval; i++) {
+            optimize_strip *strip = &strips[i];
+            uint32_t start = (uint32_t)((uint64_t)image->height * i / strip_count);
+            uint32_t end = (uint32_t)((uint64_t)image->height * (i + 1) / strip_count);
+            uint32_t warmup_rows = start < strip_warmup_rows ? start : strip_warmup_rows;
 
-                // if no filter succeeds, try again at lower quantization strength
-                strength--;
+            strip->image.rows = memory_arena_alloc(arena, (warmup_rows + end - start) * sizeof(unsigned char *));
+            unsigned char *warmup_pixels = memory_arena_alloc(arena, warmup_rows * row_size);
+            if (!strip->image.rows || (warmup_rows && !warmup_pixels)) {
+                retval = OUT_OF_MEMORY_ERROR;
+                break;
             }
-            //fprintf(stderr, "row %u best cost %u filter %u strength %u\n", (unsigned int)current_y, (unsigned int)best_cost, (unsigned int)best_filter, (unsigned int)best_strength);
-            memcpy(
-                last_row_pixels,
-                image->rows[current_y],
-                image->width * image->bytes_per_pixel
-            );
-            memcpy(
-                image->rows[current_y],
-                best.pixels,
-                image->width * image->bytes_per_pixel
-            );
-            optimize_state_copy(&state, &best, image);
-            if (row_filters) {
-                unsigned char best_png_filter;
-                switch (best_filter) {
-                case pngloss_none:
-                    best_png_filter = PNG_FILTER_NONE;
-                    break;
-                case pngloss_sub:
-                    best_png_filter = PNG_FILTER_SUB;
-                    break;
-                case pngloss_up:
-                    best_png_filter = PNG_FILTER_UP;
-                    break;
-                case pngloss_average:
-                    best_png_filter = PNG_FILTER_AVG;
-                    break;
-                case pngloss_paeth:
-                    best_png_filter = PNG_FILTER_PAETH;
-                    break;
-                }
-                row_filters[current_y] = best_png_filter;
+            for (uint32_t y = 0; y < warmup_rows; y++) {
+                strip->image.rows[y] = warmup_pixels + y * row_size;
+                memcpy(strip->image.rows[y], image->rows[start - warmup_rows + y], row_size);
+            }
+            memcpy(strip->image.rows + warmup_rows, image->rows + start, (end - start) * sizeof(unsigned char *));
+            strip->image.width = image->width;
+            strip->image.height = warmup_rows + end - start;
+            strip->image.bytes_per_pixel = image->bytes_per_pixel;
+            strip->row_filters = row_filters ? row_filters + start : NULL;
+            strip->original_frequency = original_frequency;
+            strip->place = (optimize_strip_place){
+                .first_y = start - warmup_rows,
+                .warmup_rows = warmup_rows
+            };
+            strip->options = *options;
+            strip->options.verbose = false;
+            // each strip counts on its own and they're summed afterwards
+            if (options->stats) {
+                strip->options.stats = &strip->stats;
             }
         }
-        // done with progress display, advance to next line for subsequent messages
-        if (verbose) {
-            fputs("\x1B[\x01G  compression complete\n", stderr);
+        if (options->stats) {
+            options->stats->state_init_seconds += optimize_stats_now() - start;
+        }
+    }
+
+    if (SUCCESS == retval) {
+        // the calling thread takes the first strip itself
+        for (uint32_t i = 1; i < strip_count; i++) {
+            started[i] = !pthread_create(&threads[i], NULL, optimize_strip_thread, &strips[i]);
+        }
+        optimize_strip_thread(&strips[0]);
+        for (uint32_t i = 1; i < strip_count; i++) {
+            if (started[i]) {
+                pthread_join(threads[i], NULL);
+            } else {
+                // couldn't get a thread, so do the work here instead
+                optimize_strip_thread(&strips[i]);
+            }
+        }
+
+        for (uint32_t i = 0; i < strip_count; i++) {
+            if (SUCCESS != strips[i].retval) {
+                retval = strips[i].retval;
+            }
+            if (options->stats) {
+                optimize_stats_add(options->stats, &strips[i].stats);
+            }
+        }
+
+        if (options->verbose) {
+            fprintf(stderr, "  optimized %u strips in parallel\n", (unsigned int)strip_count);
+        }
+    }
+
+    private_arena_end(options, &private_arena);
+    return retval;
+}
+
+pngloss_error optimize_image(
+    pngloss_image *image, unsigned char *row_filters,
+    const optimize_options *options
+) {
+    optimize_options private_options;
+    memory_arena private_arena;
+    options = private_arena_begin(options, &private_options, &private_arena);
+
+    pngloss_error retval = optimize_image_internal(image, row_filters, options, NULL, NULL);
+
+    private_arena_end(options, &private_arena);
+    return retval;
+}
+
+// Arena memory optimize_rows_init takes for one image or strip.
+static size_t optimize_rows_arena_size(
+    uint32_t width, uint_fast8_t bytes_per_pixel, bool own_histograms,
+    const optimize_options *options
+) {
+    uint_fast8_t trial_count = (options->filter_threads > 1) ? pngloss_filter_count : 2;
+    return optimize_state_arena_size(width, own_histograms) +
+        trial_count * optimize_trial_arena_size(width, bytes_per_pixel) +
+        memory_arena_padded((size_t)width * bytes_per_pixel);
+}
+
+// Arena memory optimize_image_strips or optimize_native_rows takes for an
+// image in the given format, so a job can reserve it before starting.
+size_t optimize_arena_size(
+    uint32_t width, uint32_t height, uint_fast8_t bytes_per_pixel,
+    const optimize_options *options
+) {
+    uint32_t strip_count = strip_count_for(height, options);
+    if (strip_count <= 1) {
+        return optimize_rows_arena_size(width, bytes_per_pixel, true, options);
+    }
+    return memory_arena_padded(strip_count * sizeof(optimize_strip)) +
+        memory_arena_padded(strip_count * sizeof(pthread_t)) +
+        memory_arena_padded(strip_count * sizeof(bool)) +
+        memory_arena_padded(5 * 256 * sizeof(uint32_t)) +
+        strip_count * (
+            memory_arena_padded((height / strip_count + 1 + strip_warmup_rows) * sizeof(unsigned char *)) +
+            memory_arena_padded((size_t)strip_warmup_rows * width * bytes_per_pixel) +
+            optimize_rows_arena_size(width, bytes_per_pixel, false, options)
+        );
+}
+
+#define spin_count 4
+typedef struct {
+    uint_fast8_t spin_index;
+    time_t old_sec;
+    suseconds_t old_dsec;
+} progress_display;
+
+static void print_progress(
+    progress_display *display, uint32_t y, uint32_t height,
+    uint_fast8_t progress
+) {
+    int spinner[spin_count] = {'-', '/', '|', '\\'};
+    struct timeval tp;
+    int err;
+    err = gettimeofday(&tp, NULL);
+    if (err) {
+        display->spin_index = (display->spin_index + 1) % spin_count;
+    } else {
+        suseconds_t dsec = tp.tv_usec / 100000;
+        if (display->old_sec != tp.tv_sec || display->old_dsec != dsec) {
+            display->old_sec = tp.tv_sec;
+            display->old_dsec = dsec;
+            display->spin_index = (display->spin_index + 1) % spin_count;
+        }
+    }
+
+    float percent = 100.0f * (float)(y * (pngloss_filter_count + 1) + progress) / (float)(height * (pngloss_filter_count + 1));
+
+    fprintf(stderr, "\x1B[\x01G%c %.1f%% complete", spinner[display->spin_index], percent);
+    fflush(stderr);
+}
+
+// Everything kept from one row to the next while optimizing, shared by
+// optimize_image and optimize_stream.
+typedef struct {
+    pngloss_image *image;
+    bool verbose;
+    uint_fast8_t quantization_strength;
+    int_fast16_t bleed_divider;
+    optimize_effort effort;
+    // the filter chosen for the row above, for optimize_effort_medium
+    pngloss_filter last_filter;
+    // how often each filter won the rows that tried all of them, see
+    // optimize_rows_sampled
+    uint32_t sampled_wins[5];
+    // The first row of a strip below the top. The decoder predicts it from
+    // a row another strip writes, so only filters that ignore the row above
+    // are tried on it, or UINT32_MAX when there's no such row.
+    uint32_t seam_y;
+    // see optimize_rows_clean_transparent
+    bool clean_transparent;
+    optimize_stats *stats;
+    optimize_state state;
+    // Two trials, one for the filter being tried and one holding the best
+    // filter so far. They trade places whenever a new best is found. When
+    // trying filters at once, each filter gets a trial of its own instead.
+    optimize_trial trials[2];
+    optimize_trial *filter_trial;
+    bool use_pool;
+    trial_pool pool;
+    bool pool_started;
+    unsigned char *last_row_pixels;
+    progress_display display;
+} optimize_rows;
+
+// Everything is allocated from options->arena, which must be set.
+static pngloss_error optimize_rows_init(
+    optimize_rows *rows, pngloss_image *image,
+    const optimize_options *options, uint32_t *const original_frequency[5]
+) {
+    pngloss_error retval;
+    rows->image = image;
+    rows->verbose = options->verbose;
+    rows->quantization_strength = options->quantization_strength;
+    rows->bleed_divider = options->bleed_divider;
+    rows->effort = options->effort;
+    rows->last_filter = pngloss_none;
+    memset(rows->sampled_wins, 0, sizeof(rows->sampled_wins));
+    rows->seam_y = UINT32_MAX;
+    rows->stats = options->stats;
+    rows->state = (optimize_state){
+        .color_error = NULL,
+        .symbol_frequency = NULL
+    };
+    for (uint_fast8_t i = 0; i < 2; i++) {
+        rows->trials[i] = (optimize_trial){
+            .pixels = NULL,
+            .color_error = NULL,
+            .symbol_frequency = NULL,
+            .touched_symbols = NULL
+        };
+    }
+    rows->filter_trial = &rows->trials[0];
+    rows->use_pool = (options->filter_threads > 1);
+    rows->pool_started = false;
+    rows->last_row_pixels = NULL;
+    rows->display = (progress_display){
+        .spin_index = 0
+    };
+
+    memory_arena *arena = options->arena;
+    retval = optimize_state_init(&rows->state, image, original_frequency, arena);
+    rows->clean_transparent = options->clean_transparent;
+
+    if (SUCCESS == retval && !rows->use_pool) {
+        retval = optimize_trial_init(&rows->trials[0], &rows->state, image, arena);
+    }
+    if (SUCCESS == retval && !rows->use_pool) {
+        retval = optimize_trial_init(&rows->trials[1], &rows->state, image, arena);
+    }
+
+    if (SUCCESS == retval) {
+        rows->last_row_pixels = memory_arena_calloc(arena, (size_t)image->width, image->bytes_per_pixel);
+        if (!rows->last_row_pixels) {
+            retval = OUT_OF_MEMORY_ERROR;
         }
     }
-    if (verbose) {
+
+    if (SUCCESS == retval && rows->use_pool) {
+        retval = trial_pool_init(&rows->pool, options->filter_threads, &rows->state, image, rows->last_row_pixels, rows->bleed_divider, arena);
+        rows->pool_started = true;
+    }
+
+    return retval;
+}
+
+static void optimize_rows_destroy(optimize_rows *rows) {
+    if (rows->verbose && rows->state.symbol_frequency) {
         unsigned int used_symbols = 0;
         for (uint_fast16_t i = 0; i < 256; i++) {
-            uint32_t frequency = best.symbol_frequency[i];
+            uint32_t frequency = rows->state.symbol_frequency[i];
             if (frequency) {
                 //fprintf(stderr, "  %3u %u\n", (unsigned int)i, (unsigned int)frequency);
                 used_symbols++;
@@ -324,11 +674,493 @@ pngloss_error optimize_image(
         fprintf(stderr, "  used %u unique symbols\n", used_symbols++);
     }
 
-    optimize_state_destroy(&state);
-    optimize_state_destroy(&best);
-    optimize_state_destroy(&filter_state);
-    free(last_row_pixels);
+    // everything else lives in the arena
+    if (rows->pool_started) {
+        trial_pool_destroy(&rows->pool);
+    }
+}
+
+static unsigned char png_filter_for(pngloss_filter filter) {
+    switch (filter) {
+    case pngloss_sub:
+        return PNG_FILTER_SUB;
+    case pngloss_up:
+        return PNG_FILTER_UP;
+    case pngloss_average:
+        return PNG_FILTER_AVG;
+    case pngloss_paeth:
+        return PNG_FILTER_PAETH;
+    default:
+        return PNG_FILTER_NONE;
+    }
+}
+
+// Below exhaustive effort, one row in this many still tries every filter.
+static const uint32_t effort_sample_period = 16;
+
+// Whether row y tries every filter to learn which one suits the image.
+// The adaptive guess alone often picks a filter that quantizes worse than
+// another, most of all at high strengths, so the filter that wins these
+// rows most often is tried on every row in between as well.
+static bool optimize_rows_sampled(const optimize_rows *rows, uint32_t y) {
+    return optimize_effort_exhaustive != rows->effort && y % effort_sample_period == 1;
+}
+
+// The filters worth trying on the row at state.y, one bit per pngloss_filter.
+static unsigned int optimize_rows_filters(optimize_rows *rows, bool adaptive) {
+    if (rows->state.y == rows->seam_y) {
+        return (1u << pngloss_none) | (1u << pngloss_sub);
+    }
+    if (adaptive || optimize_effort_exhaustive == rows->effort ||
+        optimize_rows_sampled(rows, rows->state.y)) {
+        return (1u << pngloss_filter_count) - 1;
+    }
+
+    // the row still holds its original pixels, and the row above has
+    // already been optimized, as the decoder will see it
+    pngloss_image *image = rows->image;
+    uint32_t y = rows->state.y;
+    unsigned char *above_row = y > 0 ? image->rows[y - 1] : NULL;
+    unsigned int filters = 1u << adaptive_filter_for_rows(image, above_row, image->rows[y]);
+    if (optimize_effort_medium == rows->effort && y > 0) {
+        filters |= 1u << rows->last_filter;
+    }
+    uint_fast8_t top_filter = 0;
+    for (uint_fast8_t filter = 1; filter < pngloss_filter_count; filter++) {
+        if (rows->sampled_wins[filter] > rows->sampled_wins[top_filter]) {
+            top_filter = filter;
+        }
+    }
+    if (rows->sampled_wins[top_filter]) {
+        filters |= 1u << top_filter;
+    }
+    return filters;
+}
+
+// Gives each run of fully transparent pixels in the current row the color
+// of the first pixel in the run, before any filter is tried, so the run
+// costs next to nothing with any filter. Keeping the first color rather
+// than one for the whole image leaves the invisible colors at the edges of
+// the run, which images often fill in to blend with what's visible.
+static void optimize_rows_clean_transparent(optimize_rows *rows) {
+    pngloss_image *image = rows->image;
+    uint_fast8_t bytes_per_pixel = image->bytes_per_pixel;
+    uint_fast8_t colors = bytes_per_pixel - 1;
+    unsigned char *row = image->rows[rows->state.y];
+    for (uint32_t x = 0; x < image->width; x++) {
+        unsigned char *pixel = row + (size_t)x*bytes_per_pixel;
+        if (pixel[colors]) {
+            continue;
+        }
+        if (x > 0 && !pixel[colors - bytes_per_pixel]) {
+            memcpy(pixel, pixel - bytes_per_pixel, colors);
+        }
+    }
+}
+
+// Optimizes the row at state.y in place and commits it, returning the PNG
+// filter it was optimized for.
+static unsigned char optimize_rows_next(optimize_rows *rows, bool adaptive) {
+    pngloss_image *image = rows->image;
+    bool verbose = rows->verbose;
+    uint_fast8_t quantization_strength = rows->quantization_strength;
+    optimize_stats *stats = rows->stats;
+    optimize_trial *filter_trial = rows->filter_trial;
+    optimize_trial *best = &rows->trials[filter_trial == &rows->trials[0] ? 1 : 0];
+
+    uint32_t current_y = rows->state.y;
+    size_t row_size = (size_t)image->width * image->bytes_per_pixel;
+
+    // cleaned before anything reads the row, so every filter starts from
+    // the same colors and the check below compares cleaned rows
+    if (rows->clean_transparent && image->bytes_per_pixel % 2 == 0) {
+        optimize_rows_clean_transparent(rows);
+    }
+
+    // Below exhaustive effort, a row identical to the one above is written
+    // the same as it without trying any filters, which costs next to
+    // nothing with the up filter. The copy still diffuses its color error.
+    // last_row_pixels already holds this row's original pixels, so it
+    // stays right for the next row.
+    if (!adaptive && optimize_effort_exhaustive != rows->effort && current_y > 0 &&
+        current_y != rows->seam_y &&
+        !memcmp(image->rows[current_y], rows->last_row_pixels, row_size)) {
+        optimize_trial *repeat = rows->use_pool ? &rows->pool.trials[pngloss_up] : best;
+        optimize_trial_repeat_row(repeat, image, rows->bleed_divider);
+        memcpy(image->rows[current_y], repeat->pixels, row_size);
+        optimize_trial_commit(repeat, image);
+        if (stats) {
+            stats->repeated_rows++;
+            stats->filter_wins[pngloss_up]++;
+        }
+        rows->last_filter = pngloss_up;
+        return png_filter_for(pngloss_up);
+    }
+
+    uintmax_t best_cost = UINTMAX_MAX;
+    uint_fast8_t best_strength = 0;
+    uint_fast8_t best_filter = 0;
+    bool found_best = false;
+    uint_fast8_t strength = quantization_strength;
+    unsigned int filters = optimize_rows_filters(rows, adaptive);
+    while (!found_best) {
+    //for (uint_fast8_t strength = 0; strength <= quantization_strength; strength++)
+        optimize_state_set_strength(&rows->state, strength);
+        if (rows->use_pool) {
+            if (verbose) {
+                uint_fast8_t progress = 0;
+                if (strength != quantization_strength) {
+                    progress = pngloss_filter_count;
+                }
+                print_progress(&rows->display, current_y, image->height, progress);
+            }
+
+            // try every filter at once, keeping the first of any
+            // equally good filters just like trying them in order
+            trial_pool_run(&rows->pool, strength, adaptive, filters);
+            for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+                uintmax_t cost = rows->pool.costs[filter];
+                if (best_cost > cost) {
+                    best_cost = cost;
+                    best_filter = filter;
+                    best_strength = strength;
+                    found_best = true;
+                    best = &rows->pool.trials[filter];
+                }
+            }
+        } else for (pngloss_filter filter = 0; filter < pngloss_filter_count; filter++) {
+            if (!(filters & (1u << filter))) {
+                continue;
+            }
+            if (verbose) {
+                // print progress display
+                uint_fast8_t progress = filter;
+                if (strength != quantization_strength) {
+                    progress = pngloss_filter_count;
+                }
+                print_progress(&rows->display, current_y, image->height, progress);
+            }
+
+            // get to work, giving up as soon as the filter can't beat the
+            // best so far since it would lose to it anyway
+            optimize_trial_begin(filter_trial, image);
+            uintmax_t cost = optimize_trial_row(
+                filter_trial,
+                image,
+                rows->last_row_pixels,
+                filter,
+                strength,
+                rows->bleed_divider,
+                adaptive,
+                best_cost
+            );
+            /*
+            fprintf(stderr, "filter %u costs %lu\n", (unsigned int)filter, (unsigned long)cost);
+            if (cost < (uint32_t)-1) {
+                fprintf(stderr, "filter %u costs %u\n", (unsigned int)filter, (unsigned int)cost);
+            }
+            */
+
+            if (best_cost > cost) {
+                best_cost = cost;
+                best_filter = filter;
+                best_strength = strength;
+                found_best = true;
+                optimize_trial *swap = best;
+                best = filter_trial;
+                filter_trial = swap;
+            }
+        }
+
+        // If already at zero strength, can't try again, so fail.
+        // This should be impossible but check anyway.
+        if (!found_best && !strength) {
+            fprintf(stderr, "\naborting because no good row at y == %d\n", (int)current_y);
+            abort();
+        }
+
+        // if no filter succeeds, try again at lower quantization strength
+        if (!found_best && stats) {
+            stats->strength_fallbacks++;
+        }
+        strength--;
+    }
+    //fprintf(stderr, "row %u best cost %u filter %u strength %u\n", (unsigned int)current_y, (unsigned int)best_cost, (unsigned int)best_filter, (unsigned int)best_strength);
+    rows->filter_trial = filter_trial;
+    memcpy(
+        rows->last_row_pixels,
+        image->rows[current_y],
+        row_size
+    );
+    memcpy(
+        image->rows[current_y],
+        best->pixels,
+        row_size
+    );
+    optimize_trial_commit(best, image);
+    if (stats) {
+        stats->filter_wins[best_filter]++;
+    }
+    rows->last_filter = best_filter;
+    if (optimize_rows_sampled(rows, current_y)) {
+        rows->sampled_wins[best_filter]++;
+    }
+    return png_filter_for(best_filter);
+}
+
+// place is NULL for a whole image, which is the same as a strip at the
+// top with no warm-up rows.
+static pngloss_error optimize_image_internal(
+    pngloss_image *image, unsigned char *row_filters,
+    const optimize_options *options, uint32_t *const original_frequency[5],
+    const optimize_strip_place *place
+) {
+    optimize_stats *stats = options->stats;
+    double start = stats ? optimize_stats_now() : 0;
+    uint32_t first_y = place ? place->first_y : 0;
+    uint32_t warmup_rows = place ? place->warmup_rows : 0;
+
+    optimize_rows rows;
+    pngloss_error retval = optimize_rows_init(&rows, image, options, original_frequency);
+    if (row_filters && first_y + warmup_rows > 0) {
+        rows.seam_y = warmup_rows;
+    }
+
+    if (stats) {
+        double now = optimize_stats_now();
+        stats->state_init_seconds += now - start;
+        start = now;
+    }
+
+    if (SUCCESS == retval) {
+        while (rows.state.y < image->height) {
+            uint32_t current_y = rows.state.y;
+            bool warmup = current_y < warmup_rows;
+            // PNG spec section 5.9 says,
+            // "the first row must always be adaptively filtered"
+            bool adaptive = (!row_filters || !(first_y + current_y));
+            // warm-up rows aren't part of the output, so they aren't counted
+            rows.stats = warmup ? NULL : stats;
+            unsigned char png_filter = optimize_rows_next(&rows, adaptive);
+            if (row_filters && !warmup) {
+                row_filters[current_y - warmup_rows] = png_filter;
+            }
+        }
+        // done with progress display, advance to next line for subsequent messages
+        if (options->verbose) {
+            fputs("\x1B[\x01G  compression complete\n", stderr);
+        }
+        if (stats) {
+            stats->rows_seconds += optimize_stats_now() - start;
+        }
+    }
+
+    optimize_rows_destroy(&rows);
 
     return retval;
 }
 
+// The rows of an image fed in one at a time. Only the row being optimized
+// and the optimized row above it are kept, in a ring of two rows. Rows are
+// returned in output_row when the caller wants a narrower format, since the
+// ring row is the context of the next one.
+struct optimize_stream {
+    pngloss_image image;
+    unsigned char *ring;
+    uint_fast8_t output_bytes_per_pixel;
+    unsigned char *output_row;
+    // whether every optimized row so far fits a gray or an opaque format
+    bool grayscale;
+    bool opaque;
+    optimize_rows rows;
+    bool rows_started;
+    double rows_seconds;
+    // used when the caller gives no arena
+    optimize_options private_options;
+    memory_arena private_arena;
+    bool private_arena_started;
+};
+
+pngloss_error optimize_stream_create(
+    optimize_stream **stream_p, uint32_t width, uint32_t height,
+    uint_fast8_t bytes_per_pixel, uint_fast8_t output_bytes_per_pixel,
+    uint32_t *const original_frequency[5], const optimize_options *options
+) {
+    optimize_stats *stats = options->stats;
+    double start = stats ? optimize_stats_now() : 0;
+
+    optimize_stream *stream = calloc(1, sizeof(optimize_stream));
+    *stream_p = stream;
+    if (!stream) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+    stream->image.width = width;
+    stream->image.height = height;
+    stream->image.bytes_per_pixel = bytes_per_pixel;
+    stream->output_bytes_per_pixel = output_bytes_per_pixel;
+    stream->grayscale = true;
+    stream->opaque = true;
+    options = private_arena_begin(options, &stream->private_options, &stream->private_arena);
+    stream->private_arena_started = (options == &stream->private_options);
+
+    // the optimizer indexes rows by y, so every row gets a pointer even
+    // though only two rows of pixels exist
+    stream->image.rows = memory_arena_calloc(options->arena, height, sizeof(unsigned char *));
+    stream->ring = memory_arena_calloc(options->arena, 2 * (size_t)width, bytes_per_pixel);
+    if (output_bytes_per_pixel != bytes_per_pixel) {
+        // rows are narrowed in place, so this has room for the wider row
+        stream->output_row = memory_arena_calloc(options->arena, width, bytes_per_pixel);
+    }
+    if (!stream->image.rows || !stream->ring || (output_bytes_per_pixel != bytes_per_pixel && !stream->output_row)) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+
+    pngloss_error retval = optimize_rows_init(&stream->rows, &stream->image, options, original_frequency);
+    stream->rows_started = true;
+
+    if (stats) {
+        stats->state_init_seconds += optimize_stats_now() - start;
+    }
+    return retval;
+}
+
+unsigned char optimize_stream_row(
+    optimize_stream *stream, const unsigned char *row, unsigned char **optimized
+) {
+    pngloss_image *image = &stream->image;
+    optimize_stats *stats = stream->rows.stats;
+    double start = stats ? optimize_stats_now() : 0;
+
+    uint32_t y = stream->rows.state.y;
+    size_t row_bytes = (size_t)image->width * image->bytes_per_pixel;
+    if (y >= 2) {
+        image->rows[y - 2] = NULL;
+    }
+    image->rows[y] = stream->ring + (y % 2) * row_bytes;
+    memcpy(image->rows[y], row, row_bytes);
+
+    // rows are written as they're optimized, so the filter is always chosen
+    // here, and the first row is adaptively filtered as the PNG spec says
+    unsigned char png_filter = optimize_rows_next(&stream->rows, !y);
+    *optimized = image->rows[y];
+
+    uint_fast8_t bytes_per_pixel = image->bytes_per_pixel;
+    if ((bytes_per_pixel >= 3 && stream->grayscale) || (bytes_per_pixel % 2 == 0 && stream->opaque)) {
+        uint_fast8_t row_format = narrowest_format(&image->rows[y], image->width, 1, bytes_per_pixel);
+        stream->grayscale = stream->grayscale && row_format <= 2;
+        stream->opaque = stream->opaque && row_format % 2 == 1;
+    }
+    if (stream->output_row) {
+        memcpy(stream->output_row, image->rows[y], row_bytes);
+        narrow_rows_in_place(&stream->output_row, image->width, 1, bytes_per_pixel, stream->output_bytes_per_pixel);
+        *optimized = stream->output_row;
+    }
+
+    if (stream->rows.verbose && stream->rows.state.y == image->height) {
+        fputs("\x1B[\x01G  compression complete\n", stderr);
+    }
+    if (stats) {
+        stats->rows_seconds += optimize_stats_now() - start;
+    }
+    return png_filter;
+}
+
+uint_fast8_t optimize_stream_finish(optimize_stream *stream) {
+    return format_bytes_per_pixel(stream->grayscale, stream->opaque);
+}
+
+void optimize_stream_destroy(optimize_stream *stream) {
+    if (!stream) {
+        return;
+    }
+    if (stream->rows_started) {
+        optimize_rows_destroy(&stream->rows);
+    }
+    if (stream->private_arena_started) {
+        memory_arena_destroy(&stream->private_arena);
+    }
+    free(stream);
+}
+
+// The pixel format and histograms of an image fed in a row at a time.
+// Until the last row it isn't known which formats the image fits, so every
+// format it still fits is counted.
+struct optimize_scan {
+    uint32_t width;
+    uint32_t y;
+    bool grayscale;
+    bool opaque;
+    // two rows for each format, the current one and the one above it
+    unsigned char *rows;
+    uint32_t *frequency_table;
+};
+
+pngloss_error optimize_scan_create(optimize_scan **scan_p, uint32_t width) {
+    optimize_scan *scan = calloc(1, sizeof(optimize_scan));
+    *scan_p = scan;
+    if (!scan) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+    scan->width = width;
+    scan->grayscale = true;
+    scan->opaque = true;
+    scan->rows = malloc(4 * 2 * (size_t)width * 4);
+    scan->frequency_table = calloc(4 * 5 * 256, sizeof(uint32_t));
+    if (!scan->rows || !scan->frequency_table) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+    return SUCCESS;
+}
+
+void optimize_scan_row(optimize_scan *scan, const unsigned char *rgba) {
+    uint32_t width = scan->width;
+    for (uint32_t x = 0; x < width && (scan->grayscale || scan->opaque); x++) {
+        const unsigned char *pixel = rgba + (size_t)x*4;
+        if (pixel[0] != pixel[1] || pixel[1] != pixel[2]) {
+            scan->grayscale = false;
+        }
+        if (pixel[3] < 255) {
+            scan->opaque = false;
+        }
+    }
+
+    size_t row_bytes = (size_t)width * 4;
+    for (uint_fast8_t bytes_per_pixel = 1; bytes_per_pixel <= 4; bytes_per_pixel++) {
+        bool gray_format = (bytes_per_pixel <= 2);
+        bool opaque_format = (bytes_per_pixel % 2 == 1);
+        if ((gray_format && !scan->grayscale) || (opaque_format && !scan->opaque)) {
+            continue;
+        }
+
+        unsigned char *format_rows = scan->rows + (bytes_per_pixel - 1) * 2 * row_bytes;
+        unsigned char *row = format_rows + (scan->y % 2) * row_bytes;
+        unsigned char *above_row = scan->y ? format_rows + ((scan->y + 1) % 2) * row_bytes : NULL;
+        uint32_t *original_frequency[5];
+        for (uint_fast8_t filter = 0; filter < 5; filter++) {
+            original_frequency[filter] = scan->frequency_table + ((bytes_per_pixel - 1) * 5 + filter) * 256;
+        }
+        narrow_row(rgba, row, width, bytes_per_pixel);
+        original_frequency_count_row(original_frequency, row, above_row, width, bytes_per_pixel);
+    }
+    scan->y++;
+}
+
+uint_fast8_t optimize_scan_finish(
+    optimize_scan *scan, uint32_t *original_frequency[5]
+) {
+    // the same choice optimize_with_rows makes
+    uint_fast8_t bytes_per_pixel = format_bytes_per_pixel(scan->grayscale, scan->opaque);
+    for (uint_fast8_t filter = 0; filter < 5; filter++) {
+        original_frequency[filter] = scan->frequency_table + ((bytes_per_pixel - 1) * 5 + filter) * 256;
+    }
+    return bytes_per_pixel;
+}
+
+void optimize_scan_destroy(optimize_scan *scan) {
+    if (!scan) {
+        return;
+    }
+    free(scan->rows);
+    free(scan->frequency_table);
+    free(scan);
+}
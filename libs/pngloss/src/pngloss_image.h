@@ -1,6 +1,7 @@
 #ifndef PNGLOSS_IMAGE_H
 #define PNGLOSS_IMAGE_H
 
+#include "memory_arena.h"
 #include "rwpng.h"
 
 // data structures
@@ -10,7 +11,66 @@ typedef struct {
     uint_fast8_t bytes_per_pixel;
 } pngloss_image;
 
+// Where the optimizer spent its time, in wall clock seconds, and what it
+// chose. When strips run in parallel these are summed over strips, so the
+// times can add up to more than the elapsed time.
+typedef struct {
+    // optimize_with_rows finding the pixel format and converting to it
+    double narrow_seconds;
+    // histograms, error rows and trials, before any row is tried
+    double state_init_seconds;
+    // trying filters on every row and committing the best
+    double rows_seconds;
+    // times no filter fit a row and it was tried again at lower strength
+    uint64_t strength_fallbacks;
+    // rows written the same as the identical row above them
+    uint64_t repeated_rows;
+    // rows that ended up with each filter, indexed by pngloss_filter
+    uint64_t filter_wins[5];
+} optimize_stats;
+
+// How hard to look for each row's filter. Rows the PNG spec wants filtered
+// adaptively, like the first, always try every filter.
+typedef enum {
+    // only the filter the original row looks best for by the adaptive
+    // filter heuristic, and the one that won most sampled rows
+    optimize_effort_fast,
+    // that filter and the one chosen for the row above
+    optimize_effort_medium,
+    // every filter, for the smallest file
+    optimize_effort_exhaustive
+} optimize_effort;
+
+typedef struct {
+    uint_fast8_t quantization_strength;
+    int_fast16_t bleed_divider;
+    // horizontal strips optimized at once, see optimize_image_strips
+    uint_fast16_t strip_threads;
+    // filters tried at once on each row, from 1 to 5
+    uint_fast8_t filter_threads;
+    optimize_effort effort;
+    // Give each run of fully transparent pixels in a row one color, the
+    // first pixel's, so the run costs next to nothing with any filter.
+    // Otherwise their invisible colors are kept close to the original like
+    // any other.
+    bool clean_transparent;
+    bool verbose;
+    // added to when not NULL
+    optimize_stats *stats;
+    // Scratch memory for the optimizer, which the caller resets once the
+    // image is done. When NULL each call makes and frees an arena of its
+    // own. See optimize_arena_size for how much one image takes.
+    memory_arena *arena;
+} optimize_options;
+
+// An image optimized a row at a time, see optimize_stream_create.
+typedef struct optimize_stream optimize_stream;
+// The first pass over an image optimized a row at a time.
+typedef struct optimize_scan optimize_scan;
+
 // function prototypes
+double optimize_stats_now(void);
+void optimize_stats_add(optimize_stats *total, const optimize_stats *stats);
 void optimizeForAverageFilter(
     unsigned char pixels[], int width, int height, int quantization
 );
@@ -20,12 +80,65 @@ void optimize_with_stride(
 );
 pngloss_error optimize_with_rows(
     unsigned char **rows, uint32_t width, uint32_t height,
-    unsigned char *row_filters, bool verbose,
-    uint_fast8_t quantization_strength, int_fast16_t bleed_divider
+    unsigned char *row_filters, const optimize_options *options
+);
+// Like optimize_with_rows, for rows of 1 to 4 bytes per pixel (0 is 4) as
+// rwpng_read_image24 decodes them. The rows are narrowed in place to the
+// smallest format that holds them, before optimizing and again after, and
+// stay in it with *bytes_per_pixel updated, so they can be written without
+// converting back.
+pngloss_error optimize_native_rows(
+    unsigned char **rows, uint32_t width, uint32_t height,
+    uint_fast8_t *bytes_per_pixel, unsigned char *row_filters,
+    const optimize_options *options
+);
+pngloss_error optimize_image_strips(
+    pngloss_image *image, unsigned char *row_filters,
+    const optimize_options *options
 );
 pngloss_error optimize_image(
-    pngloss_image *image, unsigned char *row_filters, bool verbose,
-    uint_fast8_t quantization_strength, int_fast16_t bleed_divider
+    pngloss_image *image, unsigned char *row_filters,
+    const optimize_options *options
+);
+size_t optimize_arena_size(
+    uint32_t width, uint32_t height, uint_fast8_t bytes_per_pixel,
+    const optimize_options *options
+);
+void narrow_row(
+    const unsigned char *rgba, unsigned char *row, uint32_t width,
+    uint_fast8_t bytes_per_pixel
+);
+
+// Counts the histograms an optimize_stream needs from the RGBA rows of the
+// original image, fed in order, and picks the same pixel format as
+// optimize_with_rows. optimize_scan_finish returns the bytes per pixel and
+// points original_frequency at tables that live until the scan is
+// destroyed. The scan must be destroyed even if creating it fails.
+pngloss_error optimize_scan_create(optimize_scan **scan_p, uint32_t width);
+void optimize_scan_row(optimize_scan *scan, const unsigned char *rgba);
+uint_fast8_t optimize_scan_finish(
+    optimize_scan *scan, uint32_t *original_frequency[5]
+);
+void optimize_scan_destroy(optimize_scan *scan);
+
+// Optimizes an image fed in one row at a time, keeping only two rows of
+// pixels, for pngloss --stream. The histograms of the whole original image
+// must be counted beforehand. Rows are optimized the same as optimize_image
+// with a single strip and row filters chosen, and returned in order with
+// their PNG filters, narrowed to output_bytes_per_pixel. Optimizing can
+// make rows fit a narrower format than the original, which
+// optimize_stream_finish returns once every row is in; a caller that wrote
+// a wider format can optimize them again, since the result is the same.
+// The stream must be destroyed even if creating it fails.
+pngloss_error optimize_stream_create(
+    optimize_stream **stream_p, uint32_t width, uint32_t height,
+    uint_fast8_t bytes_per_pixel, uint_fast8_t output_bytes_per_pixel,
+    uint32_t *const original_frequency[5], const optimize_options *options
+);
+unsigned char optimize_stream_row(
+    optimize_stream *stream, const unsigned char *row, unsigned char **optimized
 );
+uint_fast8_t optimize_stream_finish(optimize_stream *stream);
+void optimize_stream_destroy(optimize_stream *stream);
 
 #endif // PNGLOSS_IMAGE_H
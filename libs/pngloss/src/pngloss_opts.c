@@ -11,13 +11,22 @@
 #include <stdbool.h>
 #include <getopt.h>
 
+#include "pngloss_image.h"
 #include "rwpng.h"
 #include "pngloss_opts.h"
 
 extern char *optarg;
 extern int optind, opterr;
 
-enum {arg_ext, arg_no_force, arg_skip_larger, arg_strip};
+enum {arg_ext, arg_no_force, arg_skip_larger, arg_strip, arg_threads,
+    arg_filter_threads, arg_max_megapixels, arg_stats, arg_stats_json,
+    arg_zlib_preset, arg_zlib_level, arg_zlib_strategy, arg_zlib_window_bits,
+    arg_squeeze, arg_stream, arg_effort, arg_clean_transparent};
+
+// names for --zlib-strategy, indexed by rwpng_deflate_strategy
+static const char *const zlib_strategies[] = {
+    "default", "filtered", "huffman", "rle", "fixed"
+};
 
 static const struct option long_options[] = {
     {"verbose", no_argument, NULL, 'v'},
@@ -32,6 +41,20 @@ static const struct option long_options[] = {
     {"help", no_argument, NULL, 'h'},
     {"strength", required_argument, NULL, 's'},
     {"bleed", required_argument, NULL, 'b'},
+    {"threads", required_argument, NULL, arg_threads},
+    {"filter-threads", required_argument, NULL, arg_filter_threads},
+    {"effort", required_argument, NULL, arg_effort},
+    {"clean-transparent", no_argument, NULL, arg_clean_transparent},
+    {"jobs", required_argument, NULL, 'j'},
+    {"max-megapixels", required_argument, NULL, arg_max_megapixels},
+    {"stats", no_argument, NULL, arg_stats},
+    {"stats-json", no_argument, NULL, arg_stats_json},
+    {"zlib-preset", required_argument, NULL, arg_zlib_preset},
+    {"zlib-level", required_argument, NULL, arg_zlib_level},
+    {"zlib-strategy", required_argument, NULL, arg_zlib_strategy},
+    {"zlib-window-bits", required_argument, NULL, arg_zlib_window_bits},
+    {"squeeze", no_argument, NULL, arg_squeeze},
+    {"stream", no_argument, NULL, arg_stream},
     {NULL, 0, NULL, 0},
 };
 
@@ -43,8 +66,16 @@ pngloss_error pngloss_parse_options(int argc, char *argv[], struct pngloss_optio
         unsigned long strength;
         char *bleed_end;
         unsigned long bleed_divider;
+        char *threads_end;
+        unsigned long threads;
+        char *jobs_end;
+        unsigned long jobs;
+        char *megapixels_end;
+        unsigned long megapixels;
+        char *zlib_end;
+        unsigned long zlib_value;
 
-        opt = getopt_long(argc, argv, "vqfo:Vhs:b:", long_options, NULL);
+        opt = getopt_long(argc, argv, "vqfo:Vhs:b:j:", long_options, NULL);
         switch (opt) {
             case 'v':
                 options->verbose = true;
@@ -53,6 +84,13 @@ pngloss_error pngloss_parse_options(int argc, char *argv[], struct pngloss_optio
                 options->verbose = false;
                 break;
 
+            case arg_stats:
+                options->stats = true;
+                break;
+            case arg_stats_json:
+                options->stats_json = true;
+                break;
+
             case 'f': options->force = true; break;
             case arg_no_force: options->force = false; break;
 
@@ -112,6 +150,115 @@ pngloss_error pngloss_parse_options(int argc, char *argv[], struct pngloss_optio
                 }
                 break;
 
+            case arg_threads:
+                threads = strtoul(optarg, &threads_end, 10);
+                if (threads_end != optarg && '\0' == threads_end[0]) {
+                    options->threads = threads;
+                } else {
+                    fputs("--threads requires a numeric argument\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_filter_threads:
+                threads = strtoul(optarg, &threads_end, 10);
+                if (threads_end != optarg && '\0' == threads_end[0]) {
+                    options->filter_threads = threads;
+                } else {
+                    fputs("--filter-threads requires a numeric argument\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_effort:
+                if (strcmp(optarg, "fast") == 0) {
+                    options->effort = optimize_effort_fast;
+                } else if (strcmp(optarg, "medium") == 0) {
+                    options->effort = optimize_effort_medium;
+                } else if (strcmp(optarg, "exhaustive") == 0) {
+                    options->effort = optimize_effort_exhaustive;
+                } else {
+                    fputs("--effort must be fast, medium or exhaustive\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case 'j':
+                jobs = strtoul(optarg, &jobs_end, 10);
+                if (jobs_end != optarg && '\0' == jobs_end[0]) {
+                    options->jobs = jobs;
+                } else {
+                    fputs("-j, --jobs requires a numeric argument\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_max_megapixels:
+                megapixels = strtoul(optarg, &megapixels_end, 10);
+                if (megapixels_end != optarg && '\0' == megapixels_end[0]) {
+                    options->max_megapixels = megapixels;
+                } else {
+                    fputs("--max-megapixels requires a numeric argument\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_zlib_preset:
+                if (strcmp(optarg, "max") == 0) {
+                    options->zlib_preset = &rwpng_deflate_max;
+                } else if (strcmp(optarg, "latency") == 0) {
+                    options->zlib_preset = &rwpng_deflate_latency;
+                } else {
+                    fputs("--zlib-preset must be max or latency\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_zlib_level:
+                zlib_value = strtoul(optarg, &zlib_end, 10);
+                if (zlib_end != optarg && '\0' == zlib_end[0] && zlib_value <= 9) {
+                    options->zlib_level = (long)zlib_value;
+                } else {
+                    fputs("--zlib-level requires a number from 0 to 9\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_zlib_strategy:
+                options->zlib_strategy = -1;
+                for (long i = 0; i < (long)(sizeof(zlib_strategies) / sizeof(zlib_strategies[0])); i++) {
+                    if (strcmp(optarg, zlib_strategies[i]) == 0) {
+                        options->zlib_strategy = i;
+                    }
+                }
+                if (options->zlib_strategy < 0) {
+                    fputs("--zlib-strategy must be default, filtered, huffman, rle or fixed\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_zlib_window_bits:
+                zlib_value = strtoul(optarg, &zlib_end, 10);
+                if (zlib_end != optarg && '\0' == zlib_end[0] && zlib_value >= 8 && zlib_value <= 15) {
+                    options->zlib_window_bits = (long)zlib_value;
+                } else {
+                    fputs("--zlib-window-bits requires a number from 8 to 15\n", stderr);
+                    return INVALID_ARGUMENT;
+                }
+                break;
+
+            case arg_clean_transparent:
+                options->clean_transparent = true;
+                break;
+
+            case arg_squeeze:
+                options->squeeze = true;
+                break;
+
+            case arg_stream:
+                options->stream = true;
+                break;
+
             case -1: break;
 
             default:
@@ -119,6 +266,17 @@ pngloss_error pngloss_parse_options(int argc, char *argv[], struct pngloss_optio
         }
     } while (opt != -1);
 
+    options->deflate = options->zlib_preset ? *options->zlib_preset : rwpng_deflate_max;
+    if (options->zlib_level >= 0) {
+        options->deflate.level = (int)options->zlib_level;
+    }
+    if (options->zlib_strategy >= 0) {
+        options->deflate.strategy = (rwpng_deflate_strategy)options->zlib_strategy;
+    }
+    if (options->zlib_window_bits >= 0) {
+        options->deflate.window_bits = (int)options->zlib_window_bits;
+    }
+
     int argn = optind;
 
     if (argn < argc) {
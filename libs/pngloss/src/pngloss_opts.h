@@ -7,11 +7,21 @@ struct pngloss_options {
     char *const *files;
     unsigned long strength;
     unsigned long bleed_divider;
+    unsigned long threads;
+    unsigned long filter_threads;
+    optimize_effort effort;
+    unsigned long jobs;
+    unsigned long max_megapixels;
+    // --zlib-preset, overridden by the other --zlib options that aren't -1
+    const rwpng_deflate_options *zlib_preset;
+    long zlib_level, zlib_window_bits, zlib_strategy;
+    // the settings all of those add up to
+    rwpng_deflate_options deflate;
     unsigned int num_files;
     bool using_stdin, using_stdout, force,
         skip_if_larger, strip,
         print_help, print_version, missing_arguments,
-        verbose;
+        verbose, stats, stats_json, squeeze, stream, clean_transparent;
 };
 
 pngloss_error pngloss_parse_options(int argc, char *argv[], struct pngloss_options *options);
@@ -12,9 +12,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
 #include <png.h>  // if this include fails, you need to install libpng (e.g. libpng-devel package)
 
 #if USE_LCMS
+#include <sys/time.h>
 #include "lcms2.h"
 #endif
 #include "rwpng.h"
@@ -64,8 +66,11 @@ void rwpng_version_info(FILE *fp)
 }
 
 
+// reads from fp, or from buffer when fp is NULL
 struct rwpng_read_data {
-    FILE *const fp;
+    FILE *fp;
+    const unsigned char *buffer;
+    png_size_t buffer_size;
     png_size_t bytes_read;
 };
 
@@ -74,6 +79,15 @@ static void user_read_data(png_structp png_ptr, png_bytep data, png_size_t lengt
 {
     struct rwpng_read_data *read_data = (struct rwpng_read_data *)png_get_io_ptr(png_ptr);
 
+    if (!read_data->fp) {
+        if (length > read_data->buffer_size - read_data->bytes_read) {
+            png_error(png_ptr, "Read error");
+        }
+        memcpy(data, read_data->buffer + read_data->bytes_read, length);
+        read_data->bytes_read += length;
+        return;
+    }
+
     png_size_t read = fread(data, 1, length, read_data->fp);
     if (!read) {
         png_error(png_ptr, "Read error");
@@ -82,8 +96,11 @@ static void user_read_data(png_structp png_ptr, png_bytep data, png_size_t lengt
 }
 #endif
 
+// writes to outfile, or to a growing buffer when outfile is NULL
 struct rwpng_write_state {
     FILE *outfile;
+    unsigned char *buffer;
+    png_size_t buffer_capacity;
     png_size_t maximum_file_size;
     png_size_t bytes_written;
     pngloss_error retval;
@@ -97,7 +114,22 @@ static void user_write_data(png_structp png_ptr, png_bytep data, png_size_t leng
         return;
     }
 
-    if (!fwrite(data, length, 1, write_state->outfile)) {
+    if (!write_state->outfile) {
+        if (length > write_state->buffer_capacity - write_state->bytes_written) {
+            png_size_t capacity = write_state->buffer_capacity ? write_state->buffer_capacity : 4096;
+            while (length > capacity - write_state->bytes_written) {
+                capacity *= 2;
+            }
+            unsigned char *buffer = realloc(write_state->buffer, capacity);
+            if (!buffer) {
+                write_state->retval = OUT_OF_MEMORY_ERROR;
+                return;
+            }
+            write_state->buffer = buffer;
+            write_state->buffer_capacity = capacity;
+        }
+        memcpy(write_state->buffer + write_state->bytes_written, data, length);
+    } else if (!fwrite(data, length, 1, write_state->outfile)) {
         write_state->retval = CANT_WRITE_ERROR;
     }
 
@@ -176,11 +208,13 @@ static void rwpng_warning_silent_handler(png_structp png_ptr, png_const_charp ms
 #pragma unused(png_ptr, msg)
 }
 
-static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainprog_ptr, bool strip, bool verbose)
+// Starts reading: reads everything up to the image data and sets up the
+// transforms to 8 bit RGBA, or with native set, to 8 bits per channel in
+// the image's own channels. color_type is the type before transforming.
+static pngloss_error rwpng_read_info(struct rwpng_read_data *read_data, png24_image *mainprog_ptr, bool strip, bool verbose, bool native, png_structpp png_ptr_p, png_infopp info_ptr_p, int *color_type_p)
 {
     png_structp  png_ptr = NULL;
     png_infop    info_ptr = NULL;
-    png_size_t   rowbytes;
     int          color_type, bit_depth;
 
     png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, mainprog_ptr,
@@ -217,8 +251,7 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
         png_set_read_user_chunk_fn(png_ptr, &mainprog_ptr->chunks, read_chunk_callback);
     }
 
-    struct rwpng_read_data read_data = {infile, 0};
-    png_set_read_fn(png_ptr, &read_data, user_read_data);
+    png_set_read_fn(png_ptr, read_data, user_read_data);
 
     png_read_info(png_ptr, info_ptr);  /* read all PNG info up to image data */
 
@@ -235,7 +268,11 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
 
     /* GRR TO DO:  preserve all safe-to-copy ancillary PNG chunks */
 
-    if (!(color_type & PNG_COLOR_MASK_ALPHA)) {
+    if (native) {
+        // palettes become RGB, gray below 8 bits becomes 8 bits and tRNS
+        // becomes an alpha channel; anything else stays as it is
+        png_set_expand(png_ptr);
+    } else if (!(color_type & PNG_COLOR_MASK_ALPHA)) {
 #ifdef PNG_READ_FILLER_SUPPORTED
         png_set_expand(png_ptr);
         png_set_filler(png_ptr, 65535L, PNG_FILLER_AFTER);
@@ -251,7 +288,7 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
         png_set_strip_16(png_ptr);
     }
 
-    if (!(color_type & PNG_COLOR_MASK_COLOR)) {
+    if (!native && !(color_type & PNG_COLOR_MASK_COLOR)) {
         png_set_gray_to_rgb(png_ptr);
     }
 
@@ -280,33 +317,20 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
      * get rowbytes and channels, and allocate image memory */
 
     png_read_update_info(png_ptr, info_ptr);
+    mainprog_ptr->bytes_per_pixel = png_get_channels(png_ptr, info_ptr);
 
-    rowbytes = png_get_rowbytes(png_ptr, info_ptr);
-
-    // For overflow safety reject images that won't fit in 32-bit
-    if (rowbytes > INT_MAX/mainprog_ptr->height) {
-        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-        return PNG_OUT_OF_MEMORY_ERROR;
-    }
-
-    if ((mainprog_ptr->rgba_data = malloc(rowbytes * mainprog_ptr->height)) == NULL) {
-        fprintf(stderr, "pngloss readpng:  unable to allocate image data\n");
-        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-        return PNG_OUT_OF_MEMORY_ERROR;
-    }
-
-    png_bytepp row_pointers = rwpng_create_row_pointers(info_ptr, png_ptr, mainprog_ptr->rgba_data, mainprog_ptr->height, false);
-
-    /* now we can go ahead and just read the whole image */
-
-    png_read_image(png_ptr, row_pointers);
-
-    /* and we're done!  (png_read_end() can be omitted if no processing of
-     * post-IDAT text/time/etc. is desired) */
-
-    png_read_end(png_ptr, NULL);
+    *png_ptr_p = png_ptr;
+    *info_ptr_p = info_ptr;
+    *color_type_p = color_type;
+    return SUCCESS;
+}
 
 #if USE_LCMS
+// Returns the transform from the image's embedded ICC profile, or from its
+// cHRM and gAMA chunks, to sRGB, or NULL when the colors are used as is.
+// These chunks all come before the image data.
+static cmsHTRANSFORM rwpng_color_transform_create(png_structp png_ptr, png_infop info_ptr, png24_image *mainprog_ptr, int color_type)
+{
 #if PNG_LIBPNG_VER < 10500
     png_charp ProfileData;
 #else
@@ -356,7 +380,7 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
         WhitePoint.Y = Primaries.Red.Y = Primaries.Green.Y = Primaries.Blue.Y = 1.0;
 
         cmsToneCurve *GammaTable[3];
-        GammaTable[0] = GammaTable[1] = GammaTable[2] = cmsBuildGamma(NULL, 1/gamma);
+        GammaTable[0] = GammaTable[1] = GammaTable[2] = cmsBuildGamma(NULL, 1/mainprog_ptr->gamma);
 
         hInProfile = cmsCreateRGBProfile(&WhitePoint, &Primaries, GammaTable);
 
@@ -366,15 +390,81 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
         mainprog_ptr->output_color = RWPNG_SRGB;
     }
 
-    /* transform image to sRGB colorspace */
-    if (hInProfile != NULL) {
+    if (hInProfile == NULL) {
+        return NULL;
+    }
+
+    /* only color images are transformed, which are read as RGB or RGBA */
+    cmsUInt32Number format = mainprog_ptr->bytes_per_pixel == 3 ? TYPE_RGB_8 : TYPE_RGBA_8;
+    cmsHPROFILE hOutProfile = cmsCreate_sRGBProfile();
+    cmsHTRANSFORM hTransform = cmsCreateTransform(hInProfile, format,
+                                                  hOutProfile, format,
+                                                  INTENT_PERCEPTUAL,
+                                                  0);
+    cmsCloseProfile(hOutProfile);
+    cmsCloseProfile(hInProfile);
+
+    mainprog_ptr->gamma = 0.45455;
+    return hTransform;
+}
+
+static double rwpng_now(void)
+{
+    struct timeval tp;
+    if (gettimeofday(&tp, NULL)) {
+        return 0;
+    }
+    return (double)tp.tv_sec + (double)tp.tv_usec / 1e6;
+}
+#endif
+
+static pngloss_error rwpng_read_image24_libpng(struct rwpng_read_data *read_data, png24_image *mainprog_ptr, bool strip, bool verbose)
+{
+    png_structp  png_ptr = NULL;
+    png_infop    info_ptr = NULL;
+    png_size_t   rowbytes;
+    int          color_type;
+
+    pngloss_error retval = rwpng_read_info(read_data, mainprog_ptr, strip, verbose, true, &png_ptr, &info_ptr, &color_type);
+    if (retval) {
+        return retval;
+    }
+
+    if (setjmp(mainprog_ptr->jmpbuf)) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return LIBPNG_FATAL_ERROR;   /* fatal libpng error (via longjmp()) */
+    }
+
+    rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+
+    // For overflow safety reject images that won't fit in 32-bit
+    if (rowbytes > INT_MAX/mainprog_ptr->height) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return PNG_OUT_OF_MEMORY_ERROR;
+    }
 
-        cmsHPROFILE hOutProfile = cmsCreate_sRGBProfile();
-        cmsHTRANSFORM hTransform = cmsCreateTransform(hInProfile, TYPE_RGBA_8,
-                                                      hOutProfile, TYPE_RGBA_8,
-                                                      INTENT_PERCEPTUAL,
-                                                      0);
+    if ((mainprog_ptr->rgba_data = malloc(rowbytes * mainprog_ptr->height)) == NULL) {
+        fprintf(stderr, "pngloss readpng:  unable to allocate image data\n");
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return PNG_OUT_OF_MEMORY_ERROR;
+    }
+
+    png_bytepp row_pointers = rwpng_create_row_pointers(info_ptr, png_ptr, mainprog_ptr->rgba_data, mainprog_ptr->height, false);
+
+    /* now we can go ahead and just read the whole image */
 
+    png_read_image(png_ptr, row_pointers);
+
+    /* and we're done!  (png_read_end() can be omitted if no processing of
+     * post-IDAT text/time/etc. is desired) */
+
+    png_read_end(png_ptr, NULL);
+
+#if USE_LCMS
+    /* transform image to sRGB colorspace */
+    double start = rwpng_now();
+    cmsHTRANSFORM hTransform = rwpng_color_transform_create(png_ptr, info_ptr, mainprog_ptr, color_type);
+    if (hTransform != NULL) {
         for (unsigned int i = 0; i < mainprog_ptr->height; i++) {
             /* It is safe to use the same block for input and output,
                when both are of the same TYPE. */
@@ -384,20 +474,30 @@ static pngloss_error rwpng_read_image24_libpng(FILE *infile, png24_image *mainpr
         }
 
         cmsDeleteTransform(hTransform);
-        cmsCloseProfile(hOutProfile);
-        cmsCloseProfile(hInProfile);
-
-        mainprog_ptr->gamma = 0.45455;
+        mainprog_ptr->color_transform_seconds = rwpng_now() - start;
     }
+#else
+    (void)color_type;
 #endif
 
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 
-    mainprog_ptr->file_size = read_data.bytes_read;
+    mainprog_ptr->file_size = read_data->bytes_read;
     mainprog_ptr->row_pointers = (unsigned char **)row_pointers;
 
     return SUCCESS;
 }
+
+struct rwpng_row_reader {
+    struct rwpng_read_data read_data;
+    png24_image *image;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    uint32_t y;
+#if USE_LCMS
+    cmsHTRANSFORM transform;
+#endif
+};
 #endif
 
 static void rwpng_free_chunks(struct rwpng_chunk *chunk) {
@@ -431,18 +531,190 @@ pngloss_error rwpng_read_image24(FILE *infile, png24_image *out, bool strip, boo
     out->input_color = RWPNG_COCOA;
     out->output_color = RWPNG_SRGB;
     out->rgba_data = (unsigned char *)pixel_data;
+    out->bytes_per_pixel = 4;
     out->row_pointers = malloc(sizeof(out->row_pointers[0])*out->height);
     for(int i=0; i < out->height; i++) {
         out->row_pointers[i] = (unsigned char *)&pixel_data[out->width*i];
     }
     return SUCCESS;
 #else
-    return rwpng_read_image24_libpng(infile, out, strip, verbose);
+    struct rwpng_read_data read_data = {infile, NULL, 0, 0};
+    return rwpng_read_image24_libpng(&read_data, out, strip, verbose);
+#endif
+}
+
+pngloss_error rwpng_read_image24_buffer(const void *buffer, size_t size, png24_image *out, bool strip, bool verbose)
+{
+#if USE_COCOA
+    // the Cocoa reader only takes files
+#pragma unused(buffer, size, out, strip, verbose)
+    return READ_ERROR;
+#else
+    struct rwpng_read_data read_data = {NULL, buffer, size, 0};
+    return rwpng_read_image24_libpng(&read_data, out, strip, verbose);
+#endif
+}
+
+#if !USE_COCOA
+static pngloss_error rwpng_row_reader_start(struct rwpng_read_data read_data, png24_image *header, bool strip, bool verbose, rwpng_row_reader **reader_p)
+{
+    rwpng_row_reader *reader = calloc(1, sizeof(rwpng_row_reader));
+    *reader_p = reader;
+    if (!reader) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+    reader->read_data = read_data;
+    reader->image = header;
+
+    int color_type;
+    pngloss_error retval = rwpng_read_info(&reader->read_data, header, strip, verbose, false, &reader->png_ptr, &reader->info_ptr, &color_type);
+    if (retval) {
+        return retval;
+    }
+
+    // rows of an interlaced image aren't finished until the last pass
+    if (png_get_interlace_type(reader->png_ptr, reader->info_ptr) != PNG_INTERLACE_NONE ||
+        png_get_rowbytes(reader->png_ptr, reader->info_ptr) != (png_size_t)header->width * 4) {
+        return WRONG_INPUT_COLOR_TYPE;
+    }
+
+#if USE_LCMS
+    double start = rwpng_now();
+    reader->transform = rwpng_color_transform_create(reader->png_ptr, reader->info_ptr, header, color_type);
+    header->color_transform_seconds = rwpng_now() - start;
+#else
+    (void)color_type;
+#endif
+
+    return SUCCESS;
+}
+#endif
+
+pngloss_error rwpng_row_reader_open(FILE *infile, png24_image *header, bool strip, bool verbose, rwpng_row_reader **reader_p)
+{
+#if USE_COCOA
+    // the Cocoa reader only reads whole images
+#pragma unused(infile, header, strip, verbose)
+    *reader_p = NULL;
+    return WRONG_INPUT_COLOR_TYPE;
+#else
+    struct rwpng_read_data read_data = {infile, NULL, 0, 0};
+    return rwpng_row_reader_start(read_data, header, strip, verbose, reader_p);
+#endif
+}
+
+pngloss_error rwpng_row_reader_open_buffer(const void *buffer, size_t size, png24_image *header, bool strip, bool verbose, rwpng_row_reader **reader_p)
+{
+#if USE_COCOA
+#pragma unused(buffer, size, header, strip, verbose)
+    *reader_p = NULL;
+    return WRONG_INPUT_COLOR_TYPE;
+#else
+    struct rwpng_read_data read_data = {NULL, buffer, size, 0};
+    return rwpng_row_reader_start(read_data, header, strip, verbose, reader_p);
 #endif
 }
 
+pngloss_error rwpng_row_reader_next(rwpng_row_reader *reader, unsigned char *row)
+{
+#if USE_COCOA
+#pragma unused(reader, row)
+    return READ_ERROR;
+#else
+    if (setjmp(reader->image->jmpbuf)) {
+        return LIBPNG_FATAL_ERROR;   /* fatal libpng error (via longjmp()) */
+    }
+
+    png_read_row(reader->png_ptr, row, NULL);
+    reader->y++;
+
+#if USE_LCMS
+    if (reader->transform) {
+        double start = rwpng_now();
+        cmsDoTransform(reader->transform, row, row, reader->image->width);
+        reader->image->color_transform_seconds += rwpng_now() - start;
+    }
+#endif
+
+    return SUCCESS;
+#endif
+}
+
+#if !USE_COCOA
+// picks up the chunks after the image data
+static pngloss_error rwpng_row_reader_end(rwpng_row_reader *reader)
+{
+    if (setjmp(reader->image->jmpbuf)) {
+        return LIBPNG_FATAL_ERROR;
+    }
+    png_read_end(reader->png_ptr, NULL);
+    reader->image->file_size = reader->read_data.bytes_read;
+    return SUCCESS;
+}
+#endif
 
-static pngloss_error rwpng_write_image_init(png24_image *mainprog_ptr, png_structpp png_ptr_p, png_infopp info_ptr_p, bool fast_compression)
+pngloss_error rwpng_row_reader_close(rwpng_row_reader *reader)
+{
+#if USE_COCOA
+#pragma unused(reader)
+    return SUCCESS;
+#else
+    if (!reader) {
+        return SUCCESS;
+    }
+
+    pngloss_error retval = SUCCESS;
+    if (reader->png_ptr && reader->y == reader->image->height) {
+        retval = rwpng_row_reader_end(reader);
+    }
+
+#if USE_LCMS
+    if (reader->transform) {
+        cmsDeleteTransform(reader->transform);
+    }
+#endif
+    if (reader->png_ptr) {
+        png_destroy_read_struct(&reader->png_ptr, &reader->info_ptr, NULL);
+    }
+    free(reader);
+
+    return retval;
+#endif
+}
+
+
+// libpng itself picks the filtered strategy for filtered rows
+const rwpng_deflate_options rwpng_deflate_max = {
+    .level = Z_BEST_COMPRESSION,
+    .mem_level = 9,
+    .window_bits = 15,
+    .strategy = RWPNG_STRATEGY_FILTERED,
+};
+
+// Run length matching finds most of what the optimizer leaves behind, since
+// its rows repeat a few small symbols, and doesn't depend on the level.
+const rwpng_deflate_options rwpng_deflate_latency = {
+    .level = Z_BEST_SPEED,
+    .mem_level = 8,
+    .window_bits = 15,
+    .strategy = RWPNG_STRATEGY_RLE,
+};
+
+// What --squeeze tries. Which one wins depends on the image: the filtered
+// strategy usually does on photos, run length matching on images the
+// optimizer flattened hard, and a smaller hash sometimes finds better
+// matches than a larger one.
+const rwpng_deflate_options rwpng_deflate_squeeze[] = {
+    {.level = 9, .mem_level = 9, .window_bits = 15, .strategy = RWPNG_STRATEGY_FILTERED},
+    {.level = 9, .mem_level = 8, .window_bits = 15, .strategy = RWPNG_STRATEGY_FILTERED},
+    {.level = 9, .mem_level = 9, .window_bits = 15, .strategy = RWPNG_STRATEGY_DEFAULT},
+    {.level = 9, .mem_level = 8, .window_bits = 15, .strategy = RWPNG_STRATEGY_DEFAULT},
+    {.level = 9, .mem_level = 9, .window_bits = 15, .strategy = RWPNG_STRATEGY_RLE},
+    {.level = 9, .mem_level = 9, .window_bits = 15, .strategy = RWPNG_STRATEGY_FIXED},
+};
+const unsigned int rwpng_deflate_squeeze_count = sizeof(rwpng_deflate_squeeze) / sizeof(rwpng_deflate_squeeze[0]);
+
+static pngloss_error rwpng_write_image_init(png24_image *mainprog_ptr, png_structpp png_ptr_p, png_infopp info_ptr_p, const rwpng_deflate_options *deflate)
 {
     /* could also replace libpng warning-handler (final NULL), but no need: */
 
@@ -468,12 +740,20 @@ static pngloss_error rwpng_write_image_init(png24_image *mainprog_ptr, png_struc
         return LIBPNG_INIT_ERROR;   /* libpng error (via longjmp()) */
     }
 
-    png_set_compression_level(*png_ptr_p, fast_compression ? Z_BEST_SPEED : Z_BEST_COMPRESSION);
-    png_set_compression_mem_level(*png_ptr_p, 9);
+    png_set_compression_level(*png_ptr_p, deflate->level);
+    png_set_compression_mem_level(*png_ptr_p, deflate->mem_level);
+    png_set_compression_window_bits(*png_ptr_p, deflate->window_bits);
+    png_set_compression_strategy(*png_ptr_p, deflate->strategy);
 
     return SUCCESS;
 }
 
+// PNG color types by bytes per pixel, less one
+static const int rwpng_color_types[4] = {
+    PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA,
+    PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGB_ALPHA
+};
+
 static void rwpng_write_end(
     png_infopp info_ptr_p, png_structpp png_ptr_p, png_bytepp row_pointers,
     unsigned char *row_filters, uint32_t height, bool strip_alpha
@@ -512,27 +792,9 @@ static void rwpng_set_gamma(png_infop info_ptr, png_structp png_ptr, double gamm
     }
 }
 
-pngloss_error rwpng_write_image24(
-    FILE *outfile, png24_image *mainprog_ptr, unsigned char *row_filters
-) {
-    png_structp png_ptr;
-    png_infop info_ptr;
-
-    pngloss_error retval = rwpng_write_image_init((png24_image *)mainprog_ptr, &png_ptr, &info_ptr, false);
-    if (retval) return retval;
-
-    png_init_io(png_ptr, outfile);
-
-    struct rwpng_write_state write_state;
-    write_state = (struct rwpng_write_state){
-        .outfile = outfile,
-        .maximum_file_size = mainprog_ptr->maximum_file_size,
-        .retval = SUCCESS,
-    };
-    png_set_write_fn(png_ptr, &write_state, user_write_data, user_flush_data);
-
-    rwpng_set_gamma(info_ptr, png_ptr, mainprog_ptr->gamma, mainprog_ptr->output_color);
-
+// copies the chunks kept when reading, counting them in metadata_size
+static void rwpng_set_chunks(png_infop info_ptr, png_structp png_ptr, png24_image *mainprog_ptr)
+{
     struct rwpng_chunk *chunk = mainprog_ptr->chunks;
     mainprog_ptr->metadata_size = 0;
     int chunk_num = 0;
@@ -553,58 +815,88 @@ pngloss_error rwpng_write_image24(
         chunk = chunk->next;
         chunk_num++;
     }
+}
 
-    // autodetect grayscale and alpha
-    bool grayscale = true;
-    bool strip_alpha = true;
-    for (uint32_t y = 0; y < mainprog_ptr->height; y++) {
-        for (uint32_t x = 0; x < mainprog_ptr->width; x++) {
-            unsigned char *pixel = mainprog_ptr->row_pointers[y] + x*4;
-            if (pixel[0] != pixel[1] || pixel[1] != pixel[2]) {
-                grayscale = false;
-            }
-            if (pixel[3] < 255) {
-                strip_alpha = false;
-            }
-        }
-        if (!grayscale && !strip_alpha) {
-            break;
-        }
+static pngloss_error rwpng_write_image24_state(
+    struct rwpng_write_state *write_state, png24_image *mainprog_ptr,
+    unsigned char *row_filters, const rwpng_deflate_options *deflate
+) {
+    png_structp png_ptr;
+    png_infop info_ptr;
+
+    if (!deflate) {
+        deflate = &rwpng_deflate_max;
     }
+    pngloss_error retval = rwpng_write_image_init((png24_image *)mainprog_ptr, &png_ptr, &info_ptr, deflate);
+    if (retval) return retval;
 
-    // saving grayscale requires different pixel format
+    png_set_write_fn(png_ptr, write_state, user_write_data, user_flush_data);
+
+    rwpng_set_gamma(info_ptr, png_ptr, mainprog_ptr->gamma, mainprog_ptr->output_color);
+
+    rwpng_set_chunks(info_ptr, png_ptr, mainprog_ptr);
+
+    uint_fast8_t bytes_per_pixel = mainprog_ptr->bytes_per_pixel ? mainprog_ptr->bytes_per_pixel : 4;
+    png_bytepp row_pointers = mainprog_ptr->row_pointers;
     unsigned char *gray_data = NULL;
-    if (grayscale) {
-        uint32_t width = mainprog_ptr->width;
-        uint32_t height = mainprog_ptr->height;
-        uint32_t rowbytes = width * 2;
-        gray_data = malloc(rowbytes * height);
-        if (gray_data) {
-            for (uint32_t y = 0; y < height; y++) {
-                for (uint32_t x = 0; x < width; x++) {
-                    unsigned char *pixel = mainprog_ptr->row_pointers[y] + x*4;
-                    // green to luminance and alpha to alpha
-                    gray_data[y*rowbytes + x*2 + 0] = pixel[1];
-                    gray_data[y*rowbytes + x*2 + 1] = pixel[3];
+    png_bytepp gray_rows = NULL;
+    bool strip_alpha = false;
+    int color_type = rwpng_color_types[bytes_per_pixel - 1];
+
+    // RGBA may hold fewer channels than it has, so autodetect grayscale and
+    // alpha; the other formats are written as they are
+    if (4 == bytes_per_pixel) {
+        bool grayscale = true;
+        strip_alpha = true;
+        for (uint32_t y = 0; y < mainprog_ptr->height; y++) {
+            for (uint32_t x = 0; x < mainprog_ptr->width; x++) {
+                unsigned char *pixel = mainprog_ptr->row_pointers[y] + x*4;
+                if (pixel[0] != pixel[1] || pixel[1] != pixel[2]) {
+                    grayscale = false;
+                }
+                if (pixel[3] < 255) {
+                    strip_alpha = false;
                 }
             }
-        } else {
-            grayscale = false;
+            if (!grayscale && !strip_alpha) {
+                break;
+            }
         }
-    }
 
-    int color_type;
-    if (grayscale) {
-        if (strip_alpha) {
-            color_type = PNG_COLOR_TYPE_GRAY;
-        } else {
-            color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+        // saving grayscale requires different pixel format
+        if (grayscale) {
+            uint32_t width = mainprog_ptr->width;
+            uint32_t height = mainprog_ptr->height;
+            uint32_t gray_rowbytes = width * 2;
+            gray_data = malloc(gray_rowbytes * height);
+            gray_rows = gray_data ? rwpng_create_row_pointers(info_ptr, png_ptr, gray_data, height, gray_rowbytes) : NULL;
+            if (gray_rows) {
+                for (uint32_t y = 0; y < height; y++) {
+                    for (uint32_t x = 0; x < width; x++) {
+                        unsigned char *pixel = mainprog_ptr->row_pointers[y] + x*4;
+                        // green to luminance and alpha to alpha
+                        gray_data[y*gray_rowbytes + x*2 + 0] = pixel[1];
+                        gray_data[y*gray_rowbytes + x*2 + 1] = pixel[3];
+                    }
+                }
+                row_pointers = gray_rows;
+            } else {
+                grayscale = false;
+            }
         }
-    } else {
-        if (strip_alpha) {
-            color_type = PNG_COLOR_TYPE_RGB;
+
+        if (grayscale) {
+            if (strip_alpha) {
+                color_type = PNG_COLOR_TYPE_GRAY;
+            } else {
+                color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+            }
         } else {
-            color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+            if (strip_alpha) {
+                color_type = PNG_COLOR_TYPE_RGB;
+            } else {
+                color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+            }
         }
     }
     png_set_IHDR(png_ptr, info_ptr, mainprog_ptr->width, mainprog_ptr->height,
@@ -612,30 +904,300 @@ pngloss_error rwpng_write_image24(
                  0, PNG_COMPRESSION_TYPE_DEFAULT,
                  PNG_FILTER_TYPE_DEFAULT);
 
-    unsigned char *base;
-    png_size_t rowbytes;
-    if (grayscale) {
-        base = gray_data;
-        rowbytes = mainprog_ptr->width * 2;
-    } else {
-        base = mainprog_ptr->rgba_data;
-        rowbytes = mainprog_ptr->width * 4;
-    }
-    png_bytepp row_pointers = rwpng_create_row_pointers(info_ptr, png_ptr, base, mainprog_ptr->height, rowbytes);
-
     rwpng_write_end(&info_ptr, &png_ptr, row_pointers, row_filters, mainprog_ptr->height, strip_alpha);
 
-    free(row_pointers);
+    free(gray_rows);
     free(gray_data);
 
-    if (SUCCESS == write_state.retval && write_state.maximum_file_size && write_state.bytes_written > write_state.maximum_file_size) {
+    if (SUCCESS != write_state->retval) {
+        return write_state->retval;
+    }
+
+    if (write_state->maximum_file_size && write_state->bytes_written > write_state->maximum_file_size) {
         return TOO_LARGE_FILE;
     }
 
-    mainprog_ptr->file_size = write_state.bytes_written;
+    mainprog_ptr->file_size = write_state->bytes_written;
+    return SUCCESS;
+}
+
+pngloss_error rwpng_write_image24(
+    FILE *outfile, png24_image *mainprog_ptr, unsigned char *row_filters,
+    const rwpng_deflate_options *deflate
+) {
+    struct rwpng_write_state write_state = {
+        .outfile = outfile,
+        .maximum_file_size = mainprog_ptr->maximum_file_size,
+        .retval = SUCCESS,
+    };
+    return rwpng_write_image24_state(&write_state, mainprog_ptr, row_filters, deflate);
+}
+
+pngloss_error rwpng_write_image24_buffer(
+    png24_image *mainprog_ptr, unsigned char *row_filters,
+    const rwpng_deflate_options *deflate, unsigned char **buffer, size_t *size
+) {
+    struct rwpng_write_state write_state = {
+        .outfile = NULL,
+        .maximum_file_size = mainprog_ptr->maximum_file_size,
+        .retval = SUCCESS,
+    };
+    pngloss_error retval = rwpng_write_image24_state(&write_state, mainprog_ptr, row_filters, deflate);
+    if (SUCCESS != retval) {
+        free(write_state.buffer);
+        return retval;
+    }
+
+    *buffer = write_state.buffer;
+    *size = write_state.bytes_written;
     return SUCCESS;
 }
 
+// One encoding tried by rwpng_write_image24_smallest_state. It has its
+// own copy of the image because libpng errors jump to the image's jmpbuf.
+typedef struct {
+    png24_image image;
+    unsigned char *row_filters;
+    const rwpng_deflate_options *deflate;
+    struct rwpng_write_state write_state;
+    pngloss_error retval;
+} rwpng_write_trial;
+
+static void *rwpng_write_trial_thread(void *context)
+{
+    rwpng_write_trial *trial = context;
+    trial->retval = rwpng_write_image24_state(&trial->write_state, &trial->image, trial->row_filters, trial->deflate);
+    return NULL;
+}
+
+// Encodes the image into memory with every candidate at once, each on its
+// own thread, and writes the smallest encoding through write_state. The
+// pixels and chunks are only read, so the trials share them.
+static pngloss_error rwpng_write_image24_smallest_state(
+    struct rwpng_write_state *write_state, png24_image *mainprog_ptr,
+    unsigned char *row_filters, const rwpng_deflate_options *candidates,
+    unsigned int count
+) {
+    if (!count) {
+        return INVALID_ARGUMENT;
+    }
+
+    pngloss_error retval = SUCCESS;
+    rwpng_write_trial *trials = calloc(count, sizeof(rwpng_write_trial));
+    pthread_t *threads = calloc(count, sizeof(pthread_t));
+    bool *started = calloc(count, sizeof(bool));
+    if (!trials || !threads || !started) {
+        retval = OUT_OF_MEMORY_ERROR;
+    }
+
+    if (SUCCESS == retval) {
+        for (unsigned int i = 0; i < count; i++) {
+            trials[i].image = *mainprog_ptr;
+            trials[i].row_filters = row_filters;
+            trials[i].deflate = &candidates[i];
+            // every size is kept for comparison, the limit is checked below
+            trials[i].write_state = (struct rwpng_write_state){
+                .outfile = NULL,
+                .maximum_file_size = 0,
+                .retval = SUCCESS,
+            };
+        }
+
+        // the calling thread takes the first trial itself
+        for (unsigned int i = 1; i < count; i++) {
+            started[i] = !pthread_create(&threads[i], NULL, rwpng_write_trial_thread, &trials[i]);
+        }
+        rwpng_write_trial_thread(&trials[0]);
+        for (unsigned int i = 1; i < count; i++) {
+            if (started[i]) {
+                pthread_join(threads[i], NULL);
+            } else {
+                // couldn't get a thread, so encode here instead
+                rwpng_write_trial_thread(&trials[i]);
+            }
+        }
+
+        // ties go to the earlier candidate, so the result is deterministic
+        rwpng_write_trial *best = NULL;
+        for (unsigned int i = 0; i < count; i++) {
+            if (SUCCESS != trials[i].retval) {
+                retval = trials[i].retval;
+            } else if (!best || best->write_state.bytes_written > trials[i].write_state.bytes_written) {
+                best = &trials[i];
+            }
+        }
+
+        if (best) {
+            retval = SUCCESS;
+            mainprog_ptr->metadata_size = best->image.metadata_size;
+            if (write_state->maximum_file_size && best->write_state.bytes_written > write_state->maximum_file_size) {
+                retval = TOO_LARGE_FILE;
+            } else if (!write_state->outfile) {
+                // hand over the winning buffer instead of copying it
+                write_state->buffer = best->write_state.buffer;
+                write_state->bytes_written = best->write_state.bytes_written;
+                best->write_state.buffer = NULL;
+            } else if (best->write_state.bytes_written && !fwrite(best->write_state.buffer, best->write_state.bytes_written, 1, write_state->outfile)) {
+                retval = CANT_WRITE_ERROR;
+            } else {
+                write_state->bytes_written = best->write_state.bytes_written;
+            }
+        }
+        if (SUCCESS == retval) {
+            mainprog_ptr->file_size = write_state->bytes_written;
+        }
+    }
+
+    if (trials) {
+        for (unsigned int i = 0; i < count; i++) {
+            free(trials[i].write_state.buffer);
+        }
+    }
+    free(trials);
+    free(threads);
+    free(started);
+
+    return retval;
+}
+
+pngloss_error rwpng_write_image24_smallest(
+    FILE *outfile, png24_image *mainprog_ptr, unsigned char *row_filters,
+    const rwpng_deflate_options *candidates, unsigned int count
+) {
+    struct rwpng_write_state write_state = {
+        .outfile = outfile,
+        .maximum_file_size = mainprog_ptr->maximum_file_size,
+        .retval = SUCCESS,
+    };
+    return rwpng_write_image24_smallest_state(&write_state, mainprog_ptr, row_filters, candidates, count);
+}
+
+pngloss_error rwpng_write_image24_smallest_buffer(
+    png24_image *mainprog_ptr, unsigned char *row_filters,
+    const rwpng_deflate_options *candidates, unsigned int count,
+    unsigned char **buffer, size_t *size
+) {
+    struct rwpng_write_state write_state = {
+        .outfile = NULL,
+        .maximum_file_size = mainprog_ptr->maximum_file_size,
+        .retval = SUCCESS,
+    };
+    pngloss_error retval = rwpng_write_image24_smallest_state(&write_state, mainprog_ptr, row_filters, candidates, count);
+    if (SUCCESS != retval) {
+        free(write_state.buffer);
+        return retval;
+    }
+
+    *buffer = write_state.buffer;
+    *size = write_state.bytes_written;
+    return SUCCESS;
+}
+
+struct rwpng_row_writer {
+    struct rwpng_write_state write_state;
+    png24_image *image;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    uint32_t y;
+};
+
+pngloss_error rwpng_row_writer_open(
+    FILE *outfile, png24_image *mainprog_ptr, uint_fast8_t bytes_per_pixel,
+    const rwpng_deflate_options *deflate, rwpng_row_writer **writer_p
+) {
+    rwpng_row_writer *writer = calloc(1, sizeof(rwpng_row_writer));
+    *writer_p = writer;
+    if (!writer) {
+        return OUT_OF_MEMORY_ERROR;
+    }
+    writer->write_state = (struct rwpng_write_state){
+        .outfile = outfile,
+        .maximum_file_size = mainprog_ptr->maximum_file_size,
+        .retval = SUCCESS,
+    };
+    writer->image = mainprog_ptr;
+
+    if (!deflate) {
+        deflate = &rwpng_deflate_max;
+    }
+    pngloss_error retval = rwpng_write_image_init(mainprog_ptr, &writer->png_ptr, &writer->info_ptr, deflate);
+    if (retval) {
+        writer->png_ptr = NULL;
+        return retval;
+    }
+
+    if (setjmp(mainprog_ptr->jmpbuf)) {
+        return LIBPNG_FATAL_ERROR;
+    }
+
+    png_set_write_fn(writer->png_ptr, &writer->write_state, user_write_data, user_flush_data);
+    rwpng_set_gamma(writer->info_ptr, writer->png_ptr, mainprog_ptr->gamma, mainprog_ptr->output_color);
+    rwpng_set_chunks(writer->info_ptr, writer->png_ptr, mainprog_ptr);
+
+    png_set_IHDR(writer->png_ptr, writer->info_ptr, mainprog_ptr->width, mainprog_ptr->height,
+                 8, rwpng_color_types[bytes_per_pixel - 1],
+                 0, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(writer->png_ptr, writer->info_ptr);
+
+    // the first row is filtered adaptively, like rwpng_write_end does
+    png_set_filter(writer->png_ptr, PNG_FILTER_TYPE_BASE, PNG_ALL_FILTERS);
+
+    return writer->write_state.retval;
+}
+
+pngloss_error rwpng_row_writer_write(rwpng_row_writer *writer, unsigned char *row, unsigned char row_filter)
+{
+    if (setjmp(writer->image->jmpbuf)) {
+        return LIBPNG_FATAL_ERROR;
+    }
+
+    if (writer->y) {
+        png_set_filter(writer->png_ptr, PNG_FILTER_TYPE_BASE, row_filter);
+    }
+    png_write_row(writer->png_ptr, row);
+    writer->y++;
+
+    return writer->write_state.retval;
+}
+
+static pngloss_error rwpng_row_writer_end(rwpng_row_writer *writer)
+{
+    if (setjmp(writer->image->jmpbuf)) {
+        return LIBPNG_FATAL_ERROR;
+    }
+    png_write_end(writer->png_ptr, NULL);
+    return SUCCESS;
+}
+
+pngloss_error rwpng_row_writer_close(rwpng_row_writer *writer)
+{
+    if (!writer) {
+        return SUCCESS;
+    }
+
+    pngloss_error retval = SUCCESS;
+    if (writer->png_ptr) {
+        if (writer->y == writer->image->height) {
+            retval = rwpng_row_writer_end(writer);
+        }
+        png_destroy_write_struct(&writer->png_ptr, &writer->info_ptr);
+    }
+
+    if (SUCCESS == retval) {
+        retval = writer->write_state.retval;
+    }
+    if (SUCCESS == retval && writer->write_state.maximum_file_size && writer->write_state.bytes_written > writer->write_state.maximum_file_size) {
+        retval = TOO_LARGE_FILE;
+    }
+    if (SUCCESS == retval) {
+        writer->image->file_size = writer->write_state.bytes_written;
+    }
+    free(writer);
+
+    return retval;
+}
+
 static void rwpng_error_handler(png_structp png_ptr, png_const_charp msg)
 {
     png24_image *mainprog_ptr;
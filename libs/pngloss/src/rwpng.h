@@ -59,6 +59,31 @@ typedef enum {
   RWPNG_COCOA, // Colors handled by Cocoa reader
 } rwpng_color_transform;
 
+// the same values as zlib's Z_*_STRATEGY constants
+typedef enum {
+  RWPNG_STRATEGY_DEFAULT = 0,
+  RWPNG_STRATEGY_FILTERED = 1,
+  RWPNG_STRATEGY_HUFFMAN_ONLY = 2,
+  RWPNG_STRATEGY_RLE = 3,
+  RWPNG_STRATEGY_FIXED = 4,
+} rwpng_deflate_strategy;
+
+// zlib settings for writing IDAT. Writers given NULL use rwpng_deflate_max.
+typedef struct {
+    int level;          // 0 (store) to 9
+    int mem_level;      // 1 to 9
+    int window_bits;    // 8 to 15
+    rwpng_deflate_strategy strategy;
+} rwpng_deflate_options;
+
+// smallest files, for batch jobs
+extern const rwpng_deflate_options rwpng_deflate_max;
+// several times faster for a few percent more bytes, for interactive use
+extern const rwpng_deflate_options rwpng_deflate_latency;
+// candidates for rwpng_write_image24_smallest, for --squeeze
+extern const rwpng_deflate_options rwpng_deflate_squeeze[];
+extern const unsigned int rwpng_deflate_squeeze_count;
+
 typedef struct {
     jmp_buf jmpbuf;
     uint32_t width;
@@ -67,8 +92,12 @@ typedef struct {
     size_t maximum_file_size;
     size_t metadata_size;
     double gamma;
+    // seconds spent converting from an embedded color profile while reading
+    double color_transform_seconds;
     unsigned char **row_pointers;
     unsigned char *rgba_data;
+    // of rgba_data: 1 gray, 2 gray and alpha, 3 RGB, or 4 (or 0) RGBA
+    uint_fast8_t bytes_per_pixel;
     struct rwpng_chunk *chunks;
     rwpng_color_transform input_color;
     rwpng_color_transform output_color;
@@ -78,12 +107,62 @@ typedef struct {
 
 void rwpng_version_info(FILE *fp);
 
+// The readers decode to 8 bits per channel in the image's own channels,
+// setting bytes_per_pixel. The writers take any of those formats; RGBA is
+// checked for gray or opaque pixels and written with fewer channels.
 pngloss_error rwpng_read_image24(
     FILE *infile, png24_image *mainprog_ptr, bool strip, bool verbose
 );
+pngloss_error rwpng_read_image24_buffer(
+    const void *buffer, size_t size, png24_image *mainprog_ptr, bool strip,
+    bool verbose
+);
 pngloss_error rwpng_write_image24(
-    FILE *outfile, png24_image *mainprog_ptr, unsigned char *row_filters
+    FILE *outfile, png24_image *mainprog_ptr, unsigned char *row_filters,
+    const rwpng_deflate_options *deflate
+);
+pngloss_error rwpng_write_image24_buffer(
+    png24_image *mainprog_ptr, unsigned char *row_filters,
+    const rwpng_deflate_options *deflate, unsigned char **buffer, size_t *size
+);
+pngloss_error rwpng_write_image24_smallest(
+    FILE *outfile, png24_image *mainprog_ptr, unsigned char *row_filters,
+    const rwpng_deflate_options *candidates, unsigned int count
+);
+pngloss_error rwpng_write_image24_smallest_buffer(
+    png24_image *mainprog_ptr, unsigned char *row_filters,
+    const rwpng_deflate_options *candidates, unsigned int count,
+    unsigned char **buffer, size_t *size
 );
 void rwpng_free_image24(png24_image *);
 
+// Reading and writing a row at a time, for pngloss --stream. The reader
+// fills header like rwpng_read_image24 does, except for the pixels, and
+// returns RGBA rows, from a file or from memory. It refuses interlaced
+// images with WRONG_INPUT_COLOR_TYPE. The writer takes rows of 1 to 4 bytes
+// per pixel, gray, gray and alpha, RGB or RGBA, each with the PNG filter to
+// use, and writes the chunks, gamma and size of mainprog_ptr. Close them
+// even when opening fails.
+typedef struct rwpng_row_reader rwpng_row_reader;
+typedef struct rwpng_row_writer rwpng_row_writer;
+
+pngloss_error rwpng_row_reader_open(
+    FILE *infile, png24_image *header, bool strip, bool verbose,
+    rwpng_row_reader **reader_p
+);
+pngloss_error rwpng_row_reader_open_buffer(
+    const void *buffer, size_t size, png24_image *header, bool strip,
+    bool verbose, rwpng_row_reader **reader_p
+);
+pngloss_error rwpng_row_reader_next(rwpng_row_reader *reader, unsigned char *row);
+pngloss_error rwpng_row_reader_close(rwpng_row_reader *reader);
+pngloss_error rwpng_row_writer_open(
+    FILE *outfile, png24_image *mainprog_ptr, uint_fast8_t bytes_per_pixel,
+    const rwpng_deflate_options *deflate, rwpng_row_writer **writer_p
+);
+pngloss_error rwpng_row_writer_write(
+    rwpng_row_writer *writer, unsigned char *row, unsigned char row_filter
+);
+pngloss_error rwpng_row_writer_close(rwpng_row_writer *writer);
+
 #endif
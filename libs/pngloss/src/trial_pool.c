@@ -0,0 +1,144 @@
+/**
+ © 2020 William MacKay.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ See the GNU General Public License for more details:
+ <http://www.gnu.org/copyleft/gpl.html>
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "trial_pool.h"
+
+// Takes filters off the current row until none are left. Called with the
+// mutex held, but releases it while a trial runs.
+static void trial_pool_work(trial_pool *pool) {
+    while (pool->next_filter < pngloss_filter_count) {
+        pngloss_filter filter = pool->next_filter++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        uintmax_t cost = UINTMAX_MAX;
+        if (pool->filters & (1u << filter)) {
+            optimize_trial *trial = &pool->trials[filter];
+            optimize_trial_begin(trial, pool->image);
+            cost = optimize_trial_row(
+                trial,
+                pool->image,
+                pool->last_row_pixels,
+                filter,
+                pool->quantization_strength,
+                pool->bleed_divider,
+                pool->adaptive,
+                UINTMAX_MAX
+            );
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->costs[filter] = cost;
+        pool->finished_filters++;
+        if (pool->finished_filters == pngloss_filter_count) {
+            pthread_cond_signal(&pool->work_done);
+        }
+    }
+}
+
+static void *trial_pool_thread(void *context) {
+    trial_pool *pool = context;
+    uintmax_t generation = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+        while (!pool->shutdown && pool->generation == generation) {
+            pthread_cond_wait(&pool->work_ready, &pool->mutex);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+        generation = pool->generation;
+        trial_pool_work(pool);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+pngloss_error trial_pool_init(
+    trial_pool *pool, uint_fast8_t thread_count, optimize_state *state,
+    pngloss_image *image, unsigned char *last_row_pixels,
+    int_fast16_t bleed_divider, memory_arena *arena
+) {
+    pngloss_error retval = SUCCESS;
+
+    // clear values in case we return early
+    memset(pool, 0, sizeof(trial_pool));
+    pool->image = image;
+    pool->last_row_pixels = last_row_pixels;
+    pool->bleed_divider = bleed_divider;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+
+    for (uint_fast8_t filter = 0; SUCCESS == retval && filter < pngloss_filter_count; filter++) {
+        retval = optimize_trial_init(&pool->trials[filter], state, image, arena);
+    }
+
+    // the thread calling trial_pool_run is one of the threads
+    if (thread_count > pngloss_filter_count) {
+        thread_count = pngloss_filter_count;
+    }
+    for (uint_fast8_t i = 1; SUCCESS == retval && i < thread_count; i++) {
+        if (pthread_create(&pool->threads[pool->thread_count], NULL, trial_pool_thread, pool)) {
+            // fewer threads is slower but still correct
+            break;
+        }
+        pool->thread_count++;
+    }
+
+    return retval;
+}
+
+// Tries the filters with a bit set in filters, leaving UINTMAX_MAX in
+// pool->costs for the rest.
+void trial_pool_run(
+    trial_pool *pool, uint_fast8_t quantization_strength, bool adaptive,
+    unsigned int filters
+) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->quantization_strength = quantization_strength;
+    pool->adaptive = adaptive;
+    pool->filters = filters;
+    pool->next_filter = 0;
+    pool->finished_filters = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+
+    trial_pool_work(pool);
+    while (pool->finished_filters < pngloss_filter_count) {
+        pthread_cond_wait(&pool->work_done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void trial_pool_destroy(trial_pool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (uint_fast8_t i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->work_done);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_mutex_destroy(&pool->mutex);
+}
@@ -0,0 +1,51 @@
+#ifndef TRIAL_POOL_H
+#define TRIAL_POOL_H
+
+#include <pthread.h>
+
+#include "optimize_state.h"
+#include "pngloss_image.h"
+#include "rwpng.h"
+
+// data structures
+
+// A few persistent threads which try every filter on the current row at
+// once. Each filter has its own trial, so the threads only share the
+// committed optimize_state, which nobody writes while a row is being tried.
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    pthread_t threads[pngloss_filter_count];
+    uint_fast8_t thread_count;
+
+    optimize_trial trials[pngloss_filter_count];
+    uintmax_t costs[pngloss_filter_count];
+
+    // the row being tried
+    pngloss_image *image;
+    unsigned char *last_row_pixels;
+    int_fast16_t bleed_divider;
+    uint_fast8_t quantization_strength;
+    bool adaptive;
+    // one bit per pngloss_filter to try
+    unsigned int filters;
+    uint_fast8_t next_filter;
+    uint_fast8_t finished_filters;
+    uintmax_t generation;
+    bool shutdown;
+} trial_pool;
+
+// function prototypes
+pngloss_error trial_pool_init(
+    trial_pool *pool, uint_fast8_t thread_count, optimize_state *state,
+    pngloss_image *image, unsigned char *last_row_pixels,
+    int_fast16_t bleed_divider, memory_arena *arena
+);
+void trial_pool_run(
+    trial_pool *pool, uint_fast8_t quantization_strength, bool adaptive,
+    unsigned int filters
+);
+void trial_pool_destroy(trial_pool *pool);
+
+#endif // TRIAL_POOL_H
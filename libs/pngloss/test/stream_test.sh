@@ -0,0 +1,22 @@
+#!/bin/sh
+# Checks that --stream writes the same file as the whole-image path, for
+# images whose optimized rows fit a narrower format than the original.
+# Usage: test/stream_test.sh ./pngloss test/*.png
+
+bin=$1
+shift
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+status=0
+for image in "$@"; do
+    for strength in 19 60; do
+        "$bin" --force --threads 1 --strength "$strength" --output "$dir/whole.png" "$image" &&
+        "$bin" --force --threads 1 --strength "$strength" --stream --output "$dir/stream.png" "$image" || exit 1
+        if ! cmp -s "$dir/whole.png" "$dir/stream.png"; then
+            echo "FAIL: $image -s $strength: --stream wrote $(wc -c < "$dir/stream.png") bytes, the whole image $(wc -c < "$dir/whole.png")"
+            status=1
+        fi
+    done
+done
+exit $status
@@ -2,6 +2,7 @@ package service
 
 import (
 	"fmt"
+	"io"
 	"log"
 	"os"
 	"os/exec"
@@ -42,29 +43,51 @@ func ProcessCompress(c *fiber.Ctx) error {
 	image := fmt.Sprintf("%s.%s", filename, fileExt)
 	outputImage := fmt.Sprintf("%s.%s", filename+"_compressed", fileExt)
 
-	// save image to ./images dir
-	err = c.SaveFile(file, fmt.Sprintf("./images/%s", image))
-
-	if err != nil {
-		log.Println("image save error --> ", err)
-		return c.JSON(fiber.Map{"status": 500, "message": "Server error", "data": nil})
-	}
-
 	inputFilePath := fmt.Sprintf("./images/%s", image)
 	outputFilePath := fmt.Sprintf("./images/%s", outputImage)
 
-	// Run FFmpeg command
 	if fileExt == "png" {
-		cmd = exec.Command("pngloss", "-o", outputFilePath, inputFilePath)
+		// compress in process straight from the upload, only writing the result
+		upload, err := file.Open()
+
+		if err != nil {
+			log.Println("image upload error --> ", err)
+			return c.JSON(fiber.Map{"status": 500, "message": "Server error", "data": nil})
+		}
+
+		data := make([]byte, file.Size)
+		_, err = io.ReadFull(upload, data)
+		upload.Close()
+
+		if err != nil {
+			log.Println("image upload error --> ", err)
+			return c.JSON(fiber.Map{"status": 500, "message": "Server error", "data": nil})
+		}
+
+		err = CompressPNG(data, outputFilePath)
+
+		if err != nil {
+			log.Println("Error converting:", err)
+			return c.SendStatus(fiber.StatusInternalServerError)
+		}
 	} else {
+		// save image to ./images dir
+		err = c.SaveFile(file, inputFilePath)
+
+		if err != nil {
+			log.Println("image save error --> ", err)
+			return c.JSON(fiber.Map{"status": 500, "message": "Server error", "data": nil})
+		}
+
+		// Run FFmpeg command
 		cmd = exec.Command("ffmpeg", "-i", inputFilePath, "-qscale:v", "25", outputFilePath)
-	}
 
-	err = cmd.Run()
+		err = cmd.Run()
 
-	if err != nil {
-		log.Println("Error converting:", err)
-		return c.SendStatus(fiber.StatusInternalServerError)
+		if err != nil {
+			log.Println("Error converting:", err)
+			return c.SendStatus(fiber.StatusInternalServerError)
+		}
 	}
 
 	// generate image url to serve to client using CDN
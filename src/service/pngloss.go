@@ -0,0 +1,80 @@
+package service
+
+/*
+#cgo CFLAGS: -I/usr/local/include
+#cgo LDFLAGS: -L/usr/local/lib -lpngloss -lpng -lpthread -lm
+#include <stdlib.h>
+#include <libpngloss.h>
+*/
+import "C"
+
+import (
+	"errors"
+	"fmt"
+	"os"
+	"runtime"
+	"strconv"
+	"unsafe"
+)
+
+// pngloss runs on the calling thread, so never run more compressions at
+// once than there are cores; extra requests wait here for a slot.
+var pnglossWorkers = make(chan struct{}, runtime.NumCPU())
+
+// PNGLossOptions chooses between small and quick output.
+type PNGLossOptions struct {
+	// Fast tries fewer filters on each row and writes with the latency
+	// zlib preset. Uploads compress several times quicker, but files come
+	// out larger, by about half in total and over ten times on screenshots
+	// with many repeated rows.
+	Fast bool
+	// CleanTransparent lets fully transparent pixels change color, which
+	// shrinks images that hide noise under transparent areas.
+	CleanTransparent bool
+}
+
+// DefaultPNGLossOptions is what CompressPNG uses: the smallest output,
+// unless PNGLOSS_FAST is set to true in the environment.
+func DefaultPNGLossOptions() PNGLossOptions {
+	fast, _ := strconv.ParseBool(os.Getenv("PNGLOSS_FAST"))
+	return PNGLossOptions{Fast: fast}
+}
+
+// Compress a PNG held in memory with the linked pngloss library and write
+// the result to outputFilePath.
+func CompressPNG(data []byte, outputFilePath string) error {
+	return CompressPNGWithOptions(data, outputFilePath, DefaultPNGLossOptions())
+}
+
+// CompressPNGWithOptions is CompressPNG with the options given.
+func CompressPNGWithOptions(data []byte, outputFilePath string, pnglossOptions PNGLossOptions) error {
+	if len(data) == 0 {
+		return errors.New("empty image")
+	}
+
+	pnglossWorkers <- struct{}{}
+	defer func() { <-pnglossWorkers }()
+
+	var options C.pngloss_compress_options
+	C.pngloss_compress_options_init(&options)
+	if pnglossOptions.Fast {
+		C.pngloss_compress_options_latency(&options)
+		options.effort = C.PNGLOSS_EFFORT_MEDIUM
+	}
+	options.clean_transparent = C.bool(pnglossOptions.CleanTransparent)
+
+	var out unsafe.Pointer
+	var outSize C.size_t
+
+	// data holds no Go pointers and pngloss keeps nothing after returning,
+	// so it can read the upload where it is without a copy
+	code := C.pngloss_compress_buffer(unsafe.Pointer(&data[0]), C.size_t(len(data)), &options, &out, &outSize)
+	runtime.KeepAlive(data)
+
+	if code != 0 {
+		return fmt.Errorf("pngloss failed with code %d", int(code))
+	}
+	defer C.pngloss_free_buffer(out)
+
+	return os.WriteFile(outputFilePath, unsafe.Slice((*byte)(out), int(outSize)), 0644)
+}
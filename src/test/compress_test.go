@@ -4,10 +4,13 @@ import (
 	"fmt"
 	"io/ioutil"
 	"net/http"
+	"os"
+	"path/filepath"
 	"testing"
 
 	"github.com/gofiber/fiber/v2"
 	"github.com/muaramasad/ubersnap-challenge/handler"
+	"github.com/muaramasad/ubersnap-challenge/service"
 	"github.com/stretchr/testify/assert"
 )
 
@@ -42,3 +45,50 @@ func TestCompressRoute(t *testing.T) {
 
 	assert.Equal(t, 200, resp.StatusCode)
 }
+
+func TestCompressPNG(t *testing.T) {
+	data, err := os.ReadFile("./image_test/image_test.png")
+	assert.Nil(t, err)
+
+	output := filepath.Join(t.TempDir(), "compressed.png")
+	assert.Nil(t, service.CompressPNG(data, output))
+
+	compressed, err := os.ReadFile(output)
+	assert.Nil(t, err)
+	assert.Equal(t, "\x89PNG\r\n\x1a\n", string(compressed[:8]))
+	assert.Less(t, len(compressed), len(data))
+
+	assert.NotNil(t, service.CompressPNG([]byte("not a png"), output))
+}
+
+func TestCompressPNGFast(t *testing.T) {
+	data, err := os.ReadFile("./image_test/image_test.png")
+	assert.Nil(t, err)
+
+	output := filepath.Join(t.TempDir(), "compressed.png")
+	assert.Nil(t, service.CompressPNGWithOptions(data, output, service.PNGLossOptions{Fast: true}))
+
+	compressed, err := os.ReadFile(output)
+	assert.Nil(t, err)
+	assert.Equal(t, "\x89PNG\r\n\x1a\n", string(compressed[:8]))
+	assert.Less(t, len(compressed), len(data))
+}
+
+func TestCompressPNGCleanTransparent(t *testing.T) {
+	data, err := os.ReadFile("./image_test/transparent_test.png")
+	assert.Nil(t, err)
+
+	dir := t.TempDir()
+	kept := filepath.Join(dir, "kept.png")
+	cleaned := filepath.Join(dir, "cleaned.png")
+	for _, fast := range []bool{false, true} {
+		assert.Nil(t, service.CompressPNGWithOptions(data, kept, service.PNGLossOptions{Fast: fast}))
+		assert.Nil(t, service.CompressPNGWithOptions(data, cleaned, service.PNGLossOptions{Fast: fast, CleanTransparent: true}))
+
+		keptInfo, err := os.Stat(kept)
+		assert.Nil(t, err)
+		cleanedInfo, err := os.Stat(cleaned)
+		assert.Nil(t, err)
+		assert.LessOrEqual(t, cleanedInfo.Size(), keptInfo.Size())
+	}
+}